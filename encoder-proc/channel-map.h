@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2024 Norihiro Kamae <norihiro@nagater.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ENCODER_CHANNELS_MAX 8
+
+/*
+ * Fixes the channel order differences between OBS (FFmpeg, Wav) and CoreAudio AAC.
+ * 'map' has the input channel for each output channel as kAudioConverterChannelMap expects.
+ */
+struct encoder_channel_map
+{
+	uint32_t channels;
+	uint32_t layout_tag; // Input and output channel layout, 0 to keep the default of the encoder
+	int32_t map[ENCODER_CHANNELS_MAX];
+};
+
+/* One entry for each OBS speaker layout. OBS has no layout with 7 channels. */
+static constexpr encoder_channel_map encoder_channel_maps[] = {
+	{1, 0, {0}},                        // mono
+	{2, 0, {0, 1}},                     // stereo
+	{3, 0, {2, 0, 1}},                  // 2.1
+	{4, (116 << 16) | 4, {2, 0, 1, 3}}, // 4.0, kAudioChannelLayoutTag_MPEG_4_0_B instead of the default quad
+	{5, 0, {2, 0, 1, 3, 4}},            // 4.1
+	{6, 0, {2, 0, 1, 4, 5, 3}},         // 5.1
+	{8, 0, {2, 0, 1, 6, 7, 4, 5, 3}},   // 7.1
+};
+
+static constexpr bool encoder_channel_map_valid(const encoder_channel_map &m)
+{
+	if (m.channels < 1 || m.channels > ENCODER_CHANNELS_MAX)
+		return false;
+
+	// Each input channel has to appear exactly once.
+	for (uint32_t i = 0; i < m.channels; i++) {
+		uint32_t count = 0;
+		for (uint32_t j = 0; j < m.channels; j++)
+			count += m.map[j] == (int32_t)i;
+		if (count != 1)
+			return false;
+	}
+
+	return true;
+}
+
+static constexpr bool encoder_channel_maps_valid()
+{
+	for (const encoder_channel_map &m : encoder_channel_maps) {
+		if (!encoder_channel_map_valid(m))
+			return false;
+	}
+	return true;
+}
+
+static_assert(encoder_channel_maps_valid(), "Invalid channel map");
+
+static constexpr bool encoder_channel_map_is_identity(const encoder_channel_map &m)
+{
+	for (uint32_t i = 0; i < m.channels; i++) {
+		if (m.map[i] != (int32_t)i)
+			return false;
+	}
+	return true;
+}
+
+/* Returns nullptr if the number of channels does not match any speaker layout. */
+static constexpr const encoder_channel_map *encoder_channel_map_find(uint32_t channels)
+{
+	for (const encoder_channel_map &m : encoder_channel_maps) {
+		if (m.channels == channels)
+			return &m;
+	}
+	return nullptr;
+}
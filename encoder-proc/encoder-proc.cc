@@ -25,13 +25,18 @@
 #include <algorithm>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <io.h>
 #include <fcntl.h>
 #include <initializer_list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <utility>
 #include <vector>
 #include "encoder-proc.h"
+#include "channel-map.h"
 #include "util.h"
 #include "encoder-proc-version.h"
 
@@ -103,6 +108,92 @@ struct asbd_builder
 	}
 };
 
+/*
+ * Contiguous FIFO for the input PCM data, with the capacity given to reserve at creation.
+ * The converter reads straight from the buffer so that nothing is copied or moved for each packet.
+ * Only the remainder, usually less than one packet, is moved to the front when the end is reached.
+ */
+struct pcm_fifo
+{
+	vector<uint8_t> buffer;
+	size_t head = 0;
+	size_t tail = 0;
+
+	bool reserve(size_t capacity)
+	{
+		try {
+			buffer.resize(capacity);
+		} catch (...) {
+			return false;
+		}
+		return true;
+	}
+
+	size_t size() const { return tail - head; }
+	size_t space() const { return buffer.size() - size(); }
+	const uint8_t *data() const { return buffer.data() + head; }
+
+	/* Fails without a change if the data does not fit. */
+	bool push(const uint8_t *data, size_t size)
+	{
+		if (size > space())
+			return false;
+
+		if (tail + size > buffer.size()) {
+			memmove(buffer.data(), buffer.data() + head, tail - head);
+			tail -= head;
+			head = 0;
+		}
+
+		memcpy(buffer.data() + tail, data, size);
+		tail += size;
+		return true;
+	}
+
+	void pop(size_t size)
+	{
+		head += size;
+		if (head == tail)
+			head = tail = 0;
+	}
+};
+
+/* Packets of input that the FIFOs hold, the largest request and the rest of the previous one */
+#define INPUT_PACKETS (ENCODER_FRAMES_PER_REQUEST_MAX + 1)
+
+static uint64_t get_time_us()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq = {0};
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+
+	LARGE_INTEGER count;
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart * 1000000 +
+			  count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+	return 0;
+#endif
+}
+
+#define ADTS_HEADER_SIZE 7
+
+struct adts_config
+{
+	uint8_t profile; // Audio object type minus 1
+	uint8_t samplerate_index;
+	uint8_t channel_config;
+};
+
+struct encoded_packet
+{
+	int64_t pts;
+	const uint8_t *data;
+	uint32_t size;
+	uint32_t flags; // ENCODER_FLAG_SHM if the packet is in the arena
+};
+
 struct ca_encoder
 {
 	UInt32 format_id = 0;
@@ -111,29 +202,78 @@ struct ca_encoder
 
 	AudioConverterRef converter = nullptr;
 
+	/* Set in the null encoder mode (option '-n'), where 'converter' stays nullptr */
+	bool null_encoder = false;
+	size_t null_packet_bytes = 0;
+
+	/* Current bitrate and the ranges the converter accepts, cached at creation for ENCODER_FLAG_SET_BITRATE */
+	UInt32 bitrate = 0;
+	vector<pair<UInt32, UInt32>> bitrate_ranges;
+
+	/* Room for each packet, and the number of packets output_buffer and packet_descs hold */
 	size_t output_buffer_size = 0;
+	size_t output_packets = 0;
 	vector<uint8_t> output_buffer;
+	vector<AudioStreamPacketDescription> packet_descs;
+	vector<encoded_packet> packets;
+
+	/* Bytes at the top of output_buffer taken by the packets of the current request */
+	size_t output_used = 0;
 
 	size_t out_frames_per_packet = 0;
 
 	size_t in_frame_size = 0;
 	size_t in_bytes_required = 0;
+	size_t in_frames_per_packet = 0;
+
+	/* Specialized for the number of channels and the sample layout, set by select_input_path */
+	bool (*push_input)(ca_encoder *, const struct encoder_data_header *, const uint8_t *) = nullptr;
+	AudioConverterComplexInputDataProc input_proc = nullptr;
 
-	vector<uint8_t> input_buffer;
-	vector<uint8_t> encode_buffer;
+	pcm_fifo input_buffer;
+
+	/* One FIFO per channel if the input is planar, input_buffer is unused then. */
+	bool planar = false;
+	vector<pcm_fifo> input_planes;
 
 	uint64_t total_samples = 0;
 	uint64_t samples_per_second = 0;
 	uint32_t priming_samples = 0;
 
+	/* Frames received so far. After ENCODER_FLAG_FLUSH, 'flushed' ends the input. */
+	uint64_t samples_in = 0;
+	bool flushed = false;
+
 	vector<uint8_t> extra_data;
 
 	size_t channels = 0;
 
+	void *shm_view = nullptr;
+	struct encoder_shm_header *shm = nullptr;
+	const uint8_t *shm_data = nullptr;
+	uint32_t shm_read_pos = 0;
+	vector<uint8_t> shm_buffer;
+
+	/* Packets are prefixed with an ADTS header if ENCODER_FLAG_ADTS was set at creation. */
+	bool adts = false;
+	adts_config adts_cfg = {};
+
+	/* Packets are encoded here if the main process has provided the arena. */
+	uint8_t *arena = nullptr;
+	uint32_t arena_write_pos = 0;
+
+	uint32_t stream_id = 0;
+
+	struct encoder_stats stats = {sizeof(struct encoder_stats)};
+
 	~ca_encoder()
 	{
 		if (converter)
 			AudioConverterDispose(converter);
+#ifdef _WIN32
+		if (shm_view)
+			UnmapViewOfFile(shm_view);
+#endif
 	}
 };
 typedef struct ca_encoder ca_encoder;
@@ -322,8 +462,20 @@ static const char *format_id_to_str(UInt32 format_id)
 	return "Unknown format";
 }
 
+static uint64_t get_peak_working_set()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters = {sizeof(counters)};
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize;
+#endif
+	return 0;
+}
+
 static void aac_destroy(ca_encoder *ca)
 {
+	CA_LOG(LOG_INFO, "Peak working set of the process: %llu KiB",
+	       (unsigned long long)(get_peak_working_set() / 1024));
 	delete ca;
 }
 
@@ -442,6 +594,39 @@ static const initializer_list<UInt32> aac_lc_formats = {
 	kAudioFormatMPEG4AAC,
 };
 
+static bool select_input_path(ca_encoder *ca, bool s16);
+
+/* The limit of a raw data block of AAC, 6144 bits for each channel */
+#define AAC_PACKET_BYTES_MAX 768
+
+/*
+ * Allocates the buffers once for the largest request, so that nothing is allocated while encoding.
+ * output_buffer holds the packets of INPUT_PACKETS and, after them, the tail of a flush in the same request.
+ */
+static bool reserve_buffers(ca_encoder *ca)
+{
+	ca->output_packets = INPUT_PACKETS + ca->priming_samples / ca->in_frames_per_packet + 2;
+
+	try {
+		ca->output_buffer.resize(ca->output_buffer_size * ca->output_packets);
+		ca->packet_descs.resize(ca->output_packets);
+		ca->packets.reserve(ca->output_packets);
+	} catch (...) {
+		return false;
+	}
+
+	if (ca->planar) {
+		ca->input_planes.resize(ca->channels);
+		for (pcm_fifo &plane : ca->input_planes) {
+			if (!plane.reserve(ca->in_bytes_required / ca->channels * INPUT_PACKETS))
+				return false;
+		}
+		return true;
+	}
+
+	return ca->input_buffer.reserve(ca->in_bytes_required * INPUT_PACKETS);
+}
+
 static ca_encoder *aac_create(const struct encoder_settings *settings)
 {
 #define STATUS_CHECK(c)                                      \
@@ -466,11 +651,24 @@ static ca_encoder *aac_create(const struct encoder_settings *settings)
 		return nullptr;
 	}
 
+	const encoder_channel_map *channel_map = encoder_channel_map_find(settings->channels);
+	if (!channel_map) {
+		CA_LOG(LOG_ERROR, "No channel layout for %u channels", settings->channels);
+		return nullptr;
+	}
+
 	ca->channels = settings->channels;
 	ca->samples_per_second = settings->samplerate_in;
+	ca->planar = (settings->flags & ENCODER_FLAG_PLANAR) != 0;
+
+	const bool s16 = (settings->flags & ENCODER_FLAG_S16) != 0;
+	const uint32_t sample_size = s16 ? sizeof(int16_t) : sizeof(float);
+	if (!select_input_path(ca.get(), s16))
+		return nullptr;
 
-	const uint32_t bytes_per_frame = sizeof(float) * settings->channels;
-	const uint32_t bits_per_channel = sizeof(float) * 8;
+	// For non-interleaved data, a frame describes one channel.
+	const uint32_t bytes_per_frame = sample_size * (ca->planar ? 1 : settings->channels);
+	const uint32_t bits_per_channel = sample_size * 8;
 
 	auto in = asbd_builder()
 			  .sample_rate((Float64)ca->samples_per_second)
@@ -481,12 +679,19 @@ static ca_encoder *aac_create(const struct encoder_settings *settings)
 			  .bits_per_channel(bits_per_channel)
 			  .format_id(kAudioFormatLinearPCM)
 			  .format_flags(kAudioFormatFlagsNativeEndian | kAudioFormatFlagIsPacked |
-					kAudioFormatFlagIsFloat | 0)
+					(s16 ? kAudioFormatFlagIsSignedInteger : kAudioFormatFlagIsFloat) |
+					(ca->planar ? kAudioFormatFlagIsNonInterleaved : 0))
 			  .asbd;
 
 	AudioStreamBasicDescription out;
 
-	UInt32 rate_control = kAudioCodecBitRateControlMode_Constant;
+	if (settings->quality > ENCODER_QUALITY_MAX || settings->rate_control > ENCODER_RATE_CONTROL_VBR_CONSTRAINED) {
+		CA_LOG(LOG_ERROR, "Invalid quality %u or rate control mode %u", settings->quality,
+		       settings->rate_control);
+		return nullptr;
+	}
+
+	UInt32 rate_control = settings->rate_control;
 
 	ca->allowed_formats = &get_allowed_formats(settings);
 
@@ -516,11 +721,16 @@ static ca_encoder *aac_create(const struct encoder_settings *settings)
 		CA_CO_DLOG_(LOG_DEBUG, "Encoder created");
 
 	OSStatus code;
-	UInt32 converter_quality = kAudioConverterQuality_Max;
+	UInt32 converter_quality = settings->quality;
 	STATUS_CHECK(AudioConverterSetProperty(ca->converter, kAudioConverterCodecQuality, sizeof(converter_quality),
 					       &converter_quality));
 
 	STATUS_CHECK(AudioConverterSetProperty(ca->converter, kAudioConverterEncodeBitRate, sizeof(bitrate), &bitrate));
+	ca->bitrate = bitrate;
+
+	auto add_range = [&](UInt32 min_, UInt32 max_) { ca->bitrate_ranges.emplace_back(min_, max_); };
+	if (!enumerate_bitrates(log, ca->converter, add_range))
+		CA_CO_DLOG_(LOG_WARNING, "Failed to get the bitrates, the bitrate cannot be changed");
 
 	UInt32 size = sizeof(in);
 	STATUS_CHECK(
@@ -534,44 +744,31 @@ static ca_encoder *aac_create(const struct encoder_settings *settings)
 	size = sizeof(primeInfo);
 	STATUS_CHECK(AudioConverterGetProperty(ca->converter, kAudioConverterPrimeInfo, &size, &primeInfo));
 
-	/*
-	 * Fix channel map differences between CoreAudio AAC, FFmpeg, Wav
-	 * New channel mappings below assume 2.1, 4.0, 4.1, 5.1, 7.1 resp.
-	 */
-
-	if (ca->channels == 3) {
-		SInt32 channelMap3[3] = {2, 0, 1};
-		AudioConverterSetProperty(ca->converter, kAudioConverterChannelMap, sizeof(channelMap3), channelMap3);
-	}
-	else if (ca->channels == 4) {
-		/*
-		 * For four channels coreaudio encoder has default channel "quad"
-		 * instead of 4.0. So explicitly set channel layout to
-		 * kAudioChannelLayoutTag_MPEG_4_0_B = (116L << 16) | 4.
-		 */
-		AudioChannelLayout inAcl = {0};
-		inAcl.mChannelLayoutTag = (116L << 16) | 4;
-		AudioConverterSetProperty(ca->converter, kAudioConverterInputChannelLayout, sizeof(inAcl), &inAcl);
-		AudioConverterSetProperty(ca->converter, kAudioConverterOutputChannelLayout, sizeof(inAcl), &inAcl);
-		SInt32 channelMap4[4] = {2, 0, 1, 3};
-		AudioConverterSetProperty(ca->converter, kAudioConverterChannelMap, sizeof(channelMap4), channelMap4);
-	}
-	else if (ca->channels == 5) {
-		SInt32 channelMap5[5] = {2, 0, 1, 3, 4};
-		AudioConverterSetProperty(ca->converter, kAudioConverterChannelMap, sizeof(channelMap5), channelMap5);
-	}
-	else if (ca->channels == 6) {
-		SInt32 channelMap6[6] = {2, 0, 1, 4, 5, 3};
-		AudioConverterSetProperty(ca->converter, kAudioConverterChannelMap, sizeof(channelMap6), channelMap6);
-	}
-	else if (ca->channels == 8) {
-		SInt32 channelMap8[8] = {2, 0, 1, 6, 7, 4, 5, 3};
-		AudioConverterSetProperty(ca->converter, kAudioConverterChannelMap, sizeof(channelMap8), channelMap8);
-	}
-
-	ca->in_frame_size = in.mBytesPerFrame;
-	size_t in_packets = out.mFramesPerPacket / in.mFramesPerPacket;
-	ca->in_bytes_required = in_packets * ca->in_frame_size;
+	if (channel_map->layout_tag) {
+		AudioChannelLayout acl = {0};
+		acl.mChannelLayoutTag = channel_map->layout_tag;
+		code = AudioConverterSetProperty(ca->converter, kAudioConverterInputChannelLayout, sizeof(acl), &acl);
+		if (code)
+			log_osstatus(LOG_WARNING, ca.get(), "AudioConverterSetProperty(InputChannelLayout)", code);
+		code = AudioConverterSetProperty(ca->converter, kAudioConverterOutputChannelLayout, sizeof(acl), &acl);
+		if (code)
+			log_osstatus(LOG_WARNING, ca.get(), "AudioConverterSetProperty(OutputChannelLayout)", code);
+	}
+
+	// The main process may have reordered the channels already.
+	if (!encoder_channel_map_is_identity(*channel_map) && !(settings->flags & ENCODER_FLAG_REMAPPED)) {
+		SInt32 map[ENCODER_CHANNELS_MAX];
+		for (size_t i = 0; i < ca->channels; i++)
+			map[i] = channel_map->map[i];
+		code = AudioConverterSetProperty(ca->converter, kAudioConverterChannelMap,
+						 (UInt32)(sizeof(SInt32) * ca->channels), map);
+		if (code)
+			log_osstatus(LOG_WARNING, ca.get(), "AudioConverterSetProperty(ChannelMap)", code);
+	}
+
+	ca->in_frame_size = in.mBytesPerFrame * (ca->planar ? ca->channels : 1);
+	ca->in_frames_per_packet = out.mFramesPerPacket / in.mFramesPerPacket;
+	ca->in_bytes_required = ca->in_frames_per_packet * ca->in_frame_size;
 
 	ca->out_frames_per_packet = out.mFramesPerPacket;
 	ca->priming_samples = primeInfo.leadingFrames;
@@ -593,94 +790,503 @@ static ca_encoder *aac_create(const struct encoder_settings *settings)
 		}
 	}
 
-	try {
-		ca->output_buffer.resize(ca->output_buffer_size);
-	} catch (...) {
-		CA_LOG(LOG_ERROR, "Failed to allocate output buffer");
+	// A higher bitrate set later may allow larger packets, up to the limit of AAC.
+	ca->output_buffer_size = max<size_t>(ca->output_buffer_size, AAC_PACKET_BYTES_MAX * ca->channels);
+
+	if (!reserve_buffers(ca.get())) {
+		CA_LOG(LOG_ERROR, "Failed to allocate buffers");
 		return nullptr;
 	}
 
 	const char *format_name = out.mFormatID == kAudioFormatMPEG4AAC_HE_V2 ? "HE-AAC v2"
 				  : out.mFormatID == kAudioFormatMPEG4AAC_HE  ? "HE-AAC"
 									      : "AAC";
+	const char *rate_name = rate_control == kAudioCodecBitRateControlMode_Constant          ? "CBR"
+				: rate_control == kAudioCodecBitRateControlMode_LongTermAverage ? "ABR"
+												: "constrained VBR";
 	CA_LOG(LOG_INFO,
 	       "settings:\n"
 	       "\tmode:          %s\n"
 	       "\tbitrate:       %u bps\n"
 	       "\tsample rate:   %llu\n"
-	       "\tcbr:           %s\n"
+	       "\trate control:  %s\n"
+	       "\tquality:       %u\n"
+	       "\tinput:         %u-bit %s, %s\n"
 	       "\toutput buffer: %lu",
-	       format_name, (unsigned int)bitrate, ca->samples_per_second,
-	       rate_control == kAudioCodecBitRateControlMode_Constant ? "on" : "off",
+	       format_name, (unsigned int)bitrate, ca->samples_per_second, rate_name, (unsigned int)converter_quality,
+	       (unsigned int)in.mBitsPerChannel, (in.mFormatFlags & kAudioFormatFlagIsFloat) ? "float" : "integer",
+	       (in.mFormatFlags & kAudioFormatFlagIsNonInterleaved) ? "planar" : "interleaved",
 	       (unsigned long)ca->output_buffer_size);
 
 	return ca.release();
 #undef STATUS_CHECK
 }
 
-static OSStatus complex_input_data_proc(AudioConverterRef inAudioConverter, UInt32 *ioNumberDataPackets,
-					AudioBufferList *ioData,
-					AudioStreamPacketDescription **outDataPacketDescription, void *inUserData)
+/* Bytes of all channels waiting to be encoded */
+static size_t input_buffer_size(const ca_encoder *ca)
 {
-	UNUSED_PARAMETER(inAudioConverter);
-	UNUSED_PARAMETER(outDataPacketDescription);
+	if (ca->planar)
+		return ca->input_planes[0].size() * ca->channels;
+	return ca->input_buffer.size();
+}
 
-	ca_encoder *ca = static_cast<ca_encoder *>(inUserData);
+/*
+ * The input is handled by a specialization for each number of channels and sample layout, picked once by
+ * select_input_path, so that the code run for each packet has the sizes as constants and no branch on the format.
+ */
+template<size_t CHANNELS, bool PLANAR, typename SAMPLE> struct input_path
+{
+	// Bytes of one frame of all channels
+	static constexpr size_t frame_size = CHANNELS * sizeof(SAMPLE);
 
-	if (ca->input_buffer.size() < ca->in_bytes_required) {
-		*ioNumberDataPackets = 0;
-		ioData->mBuffers[0].mData = NULL;
-		return 1;
+	static size_t buffered(const ca_encoder *ca)
+	{
+		if constexpr (PLANAR)
+			return ca->input_planes[0].size() * CHANNELS;
+		else
+			return ca->input_buffer.size();
+	}
+
+	static bool push(ca_encoder *ca, const struct encoder_data_header *frame, const uint8_t *frame_data)
+	{
+		if constexpr (!PLANAR) {
+			if (!ca->input_buffer.push(frame_data, frame->size)) {
+				CA_LOG(LOG_ERROR, "Request of %u bytes does not fit the input buffer", frame->size);
+				return false;
+			}
+			return true;
+		}
+
+		if (!frame->frames || frame->size % (frame->frames * frame_size)) {
+			CA_LOG(LOG_ERROR, "Request size %u does not hold %u planar frames", frame->size, frame->frames);
+			return false;
+		}
+
+		// Check every plane first so that a failure does not leave the channels out of sync.
+		for (size_t c = 0; c < CHANNELS; c++) {
+			if (ca->input_planes[c].space() < frame->size / CHANNELS) {
+				CA_LOG(LOG_ERROR, "Request of %u bytes does not fit the input buffer", frame->size);
+				return false;
+			}
+		}
+
+		const size_t plane_bytes = frame->size / frame->frames / CHANNELS;
+		for (uint32_t f = 0; f < frame->frames; f++) {
+			for (size_t c = 0; c < CHANNELS; c++) {
+				ca->input_planes[c].push(frame_data, plane_bytes);
+				frame_data += plane_bytes;
+			}
+		}
+
+		return true;
 	}
 
-	auto start = begin(ca->input_buffer);
-	auto stop = begin(ca->input_buffer) + ca->in_bytes_required;
-	ca->encode_buffer.assign(start, stop);
-	ca->input_buffer.erase(start, stop);
+	static OSStatus fill(AudioConverterRef inAudioConverter, UInt32 *ioNumberDataPackets, AudioBufferList *ioData,
+			     AudioStreamPacketDescription **outDataPacketDescription, void *inUserData)
+	{
+		UNUSED_PARAMETER(inAudioConverter);
+		UNUSED_PARAMETER(outDataPacketDescription);
 
-	*ioNumberDataPackets = (UInt32)(ca->in_bytes_required / ca->in_frame_size);
-	ioData->mNumberBuffers = 1;
+		ca_encoder *ca = static_cast<ca_encoder *>(inUserData);
 
-	ioData->mBuffers[0].mData = ca->encode_buffer.data();
-	ioData->mBuffers[0].mNumberChannels = (UInt32)ca->channels;
-	ioData->mBuffers[0].mDataByteSize = (UInt32)ca->in_bytes_required;
+		// After a flush, the rest is given as a short packet, and then no data with noErr ends the stream.
+		size_t bytes = ca->in_bytes_required;
+		if (buffered(ca) < bytes)
+			bytes = ca->flushed ? buffered(ca) : 0;
 
-	return 0;
+		if (!bytes) {
+			*ioNumberDataPackets = 0;
+			ioData->mBuffers[0].mData = NULL;
+			ioData->mBuffers[0].mDataByteSize = 0;
+			return ca->flushed ? 0 : 1;
+		}
+
+		*ioNumberDataPackets = (UInt32)(bytes / frame_size);
+
+		// The pointers stay valid until the next push, which happens after AudioConverterFillComplexBuffer
+		// returns.
+		if constexpr (PLANAR) {
+			const size_t plane_bytes = bytes / CHANNELS;
+			AudioBuffer *buffers = ioData->mBuffers;
+			ioData->mNumberBuffers = (UInt32)CHANNELS;
+			for (size_t c = 0; c < CHANNELS; c++) {
+				buffers[c].mData = (void *)ca->input_planes[c].data();
+				buffers[c].mNumberChannels = 1;
+				buffers[c].mDataByteSize = (UInt32)plane_bytes;
+				ca->input_planes[c].pop(plane_bytes);
+			}
+		}
+		else {
+			ioData->mNumberBuffers = 1;
+			ioData->mBuffers[0].mData = (void *)ca->input_buffer.data();
+			ioData->mBuffers[0].mNumberChannels = (UInt32)CHANNELS;
+			ioData->mBuffers[0].mDataByteSize = (UInt32)bytes;
+			ca->input_buffer.pop(bytes);
+		}
+
+		return 0;
+	}
+};
+
+template<size_t CHANNELS, bool PLANAR, typename SAMPLE> static bool set_input_path(ca_encoder *ca)
+{
+	ca->push_input = input_path<CHANNELS, PLANAR, SAMPLE>::push;
+	ca->input_proc = input_path<CHANNELS, PLANAR, SAMPLE>::fill;
+	return true;
+}
+
+// One case for each entry of encoder_channel_maps
+template<bool PLANAR, typename SAMPLE> static bool select_input_path(ca_encoder *ca)
+{
+	switch (ca->channels) {
+	case 1:
+		return set_input_path<1, PLANAR, SAMPLE>(ca);
+	case 2:
+		return set_input_path<2, PLANAR, SAMPLE>(ca);
+	case 3:
+		return set_input_path<3, PLANAR, SAMPLE>(ca);
+	case 4:
+		return set_input_path<4, PLANAR, SAMPLE>(ca);
+	case 5:
+		return set_input_path<5, PLANAR, SAMPLE>(ca);
+	case 6:
+		return set_input_path<6, PLANAR, SAMPLE>(ca);
+	case 8:
+		return set_input_path<8, PLANAR, SAMPLE>(ca);
+	default:
+		return false;
+	}
 }
 
-static bool aac_encode(ca_encoder *ca, const struct encoder_data_header *frame, uint8_t *frame_data,
-		       struct encoder_data_header *packet, uint8_t **packet_data)
+/* Returns false if no specialization is built for the number of channels. */
+static bool select_input_path(ca_encoder *ca, bool s16)
 {
-	ca->input_buffer.insert(end(ca->input_buffer), frame_data, frame_data + frame->size);
+	bool found;
+	if (ca->planar)
+		found = s16 ? select_input_path<true, int16_t>(ca) : select_input_path<true, float>(ca);
+	else
+		found = s16 ? select_input_path<false, int16_t>(ca) : select_input_path<false, float>(ca);
 
-	if (ca->input_buffer.size() < ca->in_bytes_required)
-		return true;
+	if (!found)
+		CA_LOG(LOG_ERROR, "No input path for %zu channels", ca->channels);
+	return found;
+}
+
+/*
+ * The null encoder mode (option '-n') replaces CoreAudio so that the transport can be measured and tested alone.
+ * Each packet takes as much input as an AAC packet does, and echoes the first bytes of it at the packet size
+ * given by the bitrate.
+ */
+#define NULL_FRAMES_PER_PACKET 1024
+#define NULL_PACKET_BYTES_MAX 8192
+
+static size_t null_packet_size(UInt32 bitrate, uint64_t samplerate)
+{
+	uint64_t size = (uint64_t)bitrate * NULL_FRAMES_PER_PACKET / 8 / samplerate;
+	return (size_t)max<uint64_t>(min<uint64_t>(size, NULL_PACKET_BYTES_MAX), 8);
+}
+
+static OSStatus null_fill_buffer(ca_encoder *ca, UInt32 *n_packets, AudioBufferList *out,
+				 AudioStreamPacketDescription *descs)
+{
+	struct {
+		AudioBufferList list;
+		AudioBuffer more[ENCODER_CHANNELS_MAX];
+	} in = {};
+	uint8_t *data = (uint8_t *)out->mBuffers[0].mData;
+	const size_t size = ca->null_packet_bytes;
+
+	UInt32 n = 0;
+	for (; n < *n_packets; n++) {
+		UInt32 frames = 0;
+		if (ca->input_proc(nullptr, &frames, &in.list, nullptr, ca) || !frames)
+			break;
+
+		uint8_t *packet = data + n * size;
+		size_t copy = min<size_t>(size, in.list.mBuffers[0].mDataByteSize);
+		memcpy(packet, in.list.mBuffers[0].mData, copy);
+		memset(packet + copy, 0, size - copy);
+
+		descs[n].mStartOffset = n * size;
+		descs[n].mVariableFramesInPacket = 0;
+		descs[n].mDataByteSize = (UInt32)size;
+	}
+
+	bool drained = n < *n_packets;
+	*n_packets = n;
+	return drained ? 1 : 0;
+}
+
+static ca_encoder *null_create(const struct encoder_settings *settings)
+{
+	static const uint32_t samplerates[] = {96000, 88200, 64000, 48000, 44100, 32000, 24000,
+					       22050, 16000, 12000, 11025, 8000,  7350};
+	uint32_t samplerate_index = 0;
+	while (samplerate_index < size(samplerates) && samplerates[samplerate_index] != settings->samplerate_in)
+		samplerate_index++;
+
+	if (!settings->bitrate || samplerate_index == size(samplerates) ||
+	    !encoder_channel_map_find(settings->channels)) {
+		CA_LOG(LOG_ERROR, "Invalid settings for the null encoder, bitrate %u, sample rate %u, %u channels",
+		       settings->bitrate, settings->samplerate_in, settings->channels);
+		return nullptr;
+	}
+
+	unique_ptr<ca_encoder> ca;
+	try {
+		ca.reset(new ca_encoder());
+	} catch (...) {
+		CA_LOG(LOG_ERROR, "Could not allocate encoder");
+		return nullptr;
+	}
+
+	ca->null_encoder = true;
+	ca->channels = settings->channels;
+	ca->samples_per_second = settings->samplerate_in;
+	ca->planar = (settings->flags & ENCODER_FLAG_PLANAR) != 0;
+	if (!select_input_path(ca.get(), (settings->flags & ENCODER_FLAG_S16) != 0))
+		return nullptr;
+
+	const size_t sample_size = (settings->flags & ENCODER_FLAG_S16) ? sizeof(int16_t) : sizeof(float);
+	ca->in_frame_size = sample_size * ca->channels;
+	ca->in_frames_per_packet = NULL_FRAMES_PER_PACKET;
+	ca->in_bytes_required = NULL_FRAMES_PER_PACKET * ca->in_frame_size;
+	ca->out_frames_per_packet = NULL_FRAMES_PER_PACKET;
+
+	ca->bitrate = settings->bitrate;
+	ca->bitrate_ranges.emplace_back(1, UINT32_MAX);
+	ca->null_packet_bytes = null_packet_size(ca->bitrate, ca->samples_per_second);
+	ca->output_buffer_size = NULL_PACKET_BYTES_MAX;
+
+	// AAC-LC AudioSpecificConfig, which also allows ADTS.
+	const uint32_t channel_config = ca->channels == 8 ? 7 : (uint32_t)ca->channels;
+	const uint16_t asc = (uint16_t)(2 << 11 | samplerate_index << 7 | channel_config << 3);
+	ca->extra_data = {(uint8_t)(asc >> 8), (uint8_t)asc};
+
+	if (!reserve_buffers(ca.get())) {
+		CA_LOG(LOG_ERROR, "Failed to allocate buffers");
+		return nullptr;
+	}
+
+	CA_LOG(LOG_INFO, "Null encoder created, %u channels, %u bytes per packet", (uint32_t)ca->channels,
+	       (uint32_t)ca->null_packet_bytes);
+
+	return ca.release();
+}
+
+static void update_input_buffer_stats(ca_encoder *ca)
+{
+	auto size = (uint32_t)input_buffer_size(ca);
+	encoder_histogram_add(&ca->stats.input_buffer, size);
+	if (size > ca->stats.input_buffer_max)
+		ca->stats.input_buffer_max = size;
+}
+
+/* Returns a contiguous slot of the arena, skipping the end of the arena if it is too short. */
+static uint8_t *arena_reserve(ca_encoder *ca, uint32_t size, uint32_t &skip)
+{
+	// The arena has no room for the ADTS header in front of each packet.
+	if (!ca->arena || ca->adts)
+		return nullptr;
+
+	const uint32_t arena_size = ca->shm->arena_size;
+#ifdef _MSC_VER
+	uint32_t read_pos = ca->shm->arena_read_pos;
+#else
+	uint32_t read_pos = __atomic_load_n(&ca->shm->arena_read_pos, __ATOMIC_ACQUIRE);
+#endif
+	uint32_t available = arena_size - (ca->arena_write_pos - read_pos);
+	uint32_t offset = ca->arena_write_pos & (arena_size - 1);
+	uint32_t tail = arena_size - offset;
+
+	skip = 0;
+	if (size <= tail && size <= available)
+		return ca->arena + offset;
+
+	// The unreleased packets may also cover the top of the arena, and then the wrap has no room.
+	if (offset && available >= tail && size <= available - tail) {
+		skip = tail;
+		return ca->arena;
+	}
+
+	return nullptr;
+}
+
+/*
+ * Encodes into 'out' until the input runs out or 'max_packets' have been written, and returns the count in
+ * 'n_total' and the bytes taken from 'out' in 'n_bytes'. The offsets in packet_descs are relative to 'out'.
+ * Before the flush, the converter is never asked for more packets than the input holds.
+ */
+static bool fill_packets(ca_encoder *ca, uint8_t *out, size_t max_packets, size_t &n_total, size_t &n_bytes)
+{
+	n_total = 0;
+	n_bytes = 0;
+	size_t used = 0;
+
+	while (n_total < max_packets) {
+		size_t n_packets = max_packets - n_total;
+		if (!ca->flushed)
+			n_packets = min(n_packets, input_buffer_size(ca) / ca->in_bytes_required);
+		if (!n_packets)
+			break;
+
+		AudioStreamPacketDescription *descs = ca->packet_descs.data() + n_total;
+		UInt32 n_out = (UInt32)n_packets;
+
+		AudioBufferList buffer_list = {0};
+		buffer_list.mNumberBuffers = 1;
+		buffer_list.mBuffers[0].mNumberChannels = (UInt32)ca->channels;
+		buffer_list.mBuffers[0].mDataByteSize = (UInt32)(ca->output_buffer_size * n_packets);
+		buffer_list.mBuffers[0].mData = out + used;
+
+		OSStatus code;
+		if (ca->null_encoder)
+			code = null_fill_buffer(ca, &n_out, &buffer_list, descs);
+		else
+			code = AudioConverterFillComplexBuffer(ca->converter, ca->input_proc, ca, &n_out, &buffer_list,
+							       descs);
+		if (code && code != 1) {
+			log_osstatus(LOG_ERROR, ca, "AudioConverterFillComplexBuffer", code);
+			return false;
+		}
+		if (!n_out)
+			break;
+
+		size_t end = used;
+		for (UInt32 i = 0; i < n_out; i++) {
+			descs[i].mStartOffset += used;
+			end = max<size_t>(end, (size_t)(descs[i].mStartOffset + descs[i].mDataByteSize));
+		}
+		used = end;
+		n_total += n_out;
+	}
+
+	n_bytes = used;
+	return true;
+}
+
+static bool aac_encode(ca_encoder *ca, const struct encoder_data_header *frame, const uint8_t *frame_data,
+		       vector<encoded_packet> &packets)
+{
+	// The packets of the previous request have been written.
+	packets.clear();
+	ca->output_used = 0;
+
+	if (ca->flushed) {
+		CA_LOG(LOG_ERROR, "The stream has been flushed, dropping %u bytes", frame->size);
+		return false;
+	}
+
+	if (frame->size % ca->in_frame_size) {
+		CA_LOG(LOG_ERROR, "Request size %u is not a multiple of the frame size %zu", frame->size,
+		       ca->in_frame_size);
+		return false;
+	}
+
+	if (!ca->push_input(ca, frame, frame_data))
+		return false;
+
+	ca->stats.frames += frame->frames;
+	ca->samples_in += frame->size / ca->in_frame_size;
 
-	UInt32 packets = 1;
+	// Encode every packet the buffered input allows so that a backlog is cleared at once.
+	// The FIFOs hold at most INPUT_PACKETS, which the output has room for.
+	const size_t max_packets = min(input_buffer_size(ca) / ca->in_bytes_required, ca->output_packets);
+	if (!max_packets) {
+		update_input_buffer_stats(ca);
+		return true;
+	}
 
-	AudioBufferList buffer_list = {0};
-	buffer_list.mNumberBuffers = 1;
-	buffer_list.mBuffers[0].mNumberChannels = (UInt32)ca->channels;
-	buffer_list.mBuffers[0].mDataByteSize = (UInt32)ca->output_buffer_size;
-	buffer_list.mBuffers[0].mData = ca->output_buffer.data();
+	uint8_t *out = ca->output_buffer.data();
+	uint32_t arena_skip = 0;
+	uint8_t *arena_slot = arena_reserve(ca, (uint32_t)(ca->output_buffer_size * max_packets), arena_skip);
+	if (arena_slot)
+		out = arena_slot;
 
-	AudioStreamPacketDescription out_desc = {0};
+	uint64_t start_us = get_time_us();
+	size_t n_out = 0, n_bytes = 0;
+	bool ok = fill_packets(ca, out, max_packets, n_out, n_bytes);
+	encoder_histogram_add(&ca->stats.encode_us, (uint32_t)(get_time_us() - start_us));
+	update_input_buffer_stats(ca);
 
-	OSStatus code = AudioConverterFillComplexBuffer(ca->converter, complex_input_data_proc, ca, &packets,
-							&buffer_list, &out_desc);
-	if (code && code != 1) {
-		log_osstatus(LOG_ERROR, ca, "AudioConverterFillComplexBuffer", code);
+	if (!ok)
 		return false;
+
+	// Packets left in the arena below are sent through the pipe but do not take output_buffer.
+	if (!arena_slot)
+		ca->output_used = n_bytes;
+
+	// The main process finds the packets in the arena only if they are back to back.
+	uint32_t arena_used = 0;
+	for (size_t i = 0; i < n_out && arena_slot; i++) {
+		if (ca->packet_descs[i].mStartOffset != arena_used)
+			arena_slot = nullptr;
+		arena_used += ca->packet_descs[i].mDataByteSize;
 	}
 
-	if (packets <= 0)
+	for (size_t i = 0; i < n_out; i++) {
+		const AudioStreamPacketDescription &desc = ca->packet_descs[i];
+		uint32_t flags = 0;
+		if (arena_slot)
+			flags |= ENCODER_FLAG_SHM | (i == 0 && arena_skip ? ENCODER_FLAG_SHM_WRAP : 0);
+		packets.push_back({
+			(int64_t)(ca->total_samples - ca->priming_samples),
+			out + desc.mStartOffset,
+			(uint32_t)desc.mDataByteSize,
+			flags,
+		});
+
+		ca->total_samples += ca->in_frames_per_packet;
+	}
+	ca->stats.packets += n_out;
+
+	if (arena_slot && n_out)
+		ca->arena_write_pos += arena_skip + arena_used;
+
+	return true;
+}
+
+/*
+ * Ends the input for ENCODER_FLAG_FLUSH and appends the packets of what was left in the input buffer and of the
+ * encoder delay to 'packets'. Packets that would start after the last input sample are dropped.
+ */
+static bool aac_flush(ca_encoder *ca, vector<encoded_packet> &packets)
+{
+	if (ca->flushed)
 		return true;
+	ca->flushed = true;
+
+	// The tail goes after the packets of the same request that are still in output_buffer.
+	uint8_t *out = ca->output_buffer.data() + ca->output_used;
+	const size_t max_packets = (ca->output_buffer.size() - ca->output_used) / ca->output_buffer_size;
+
+	uint64_t start_us = get_time_us();
+	size_t n_total = 0, n_bytes = 0;
+	bool ok = fill_packets(ca, out, max_packets, n_total, n_bytes);
+	encoder_histogram_add(&ca->stats.encode_us, (uint32_t)(get_time_us() - start_us));
+	if (!ok)
+		return false;
 
-	packet->pts = ca->total_samples - ca->priming_samples;
-	packet->size = out_desc.mDataByteSize;
-	*packet_data = (uint8_t *)buffer_list.mBuffers[0].mData + out_desc.mStartOffset;
+	size_t n_sent = 0;
+	for (size_t i = 0; i < n_total; i++) {
+		const int64_t pts = (int64_t)(ca->total_samples - ca->priming_samples);
+		if (pts >= (int64_t)ca->samples_in)
+			break;
+
+		packets.push_back({
+			pts,
+			out + ca->packet_descs[i].mStartOffset,
+			(uint32_t)ca->packet_descs[i].mDataByteSize,
+			0,
+		});
+		ca->total_samples += ca->in_frames_per_packet;
+		n_sent++;
+	}
+	ca->stats.packets += n_sent;
 
-	ca->total_samples += ca->in_bytes_required / ca->in_frame_size;
+	const int64_t padding = (int64_t)(ca->total_samples - ca->priming_samples) - (int64_t)ca->samples_in;
+	CA_LOG(LOG_INFO, "Flushed %zu packets, the last one has %lld frames of padding", n_sent,
+	       (long long)max<int64_t>(padding, 0));
 
 	return true;
 }
@@ -784,6 +1390,55 @@ static void query_extra_data(ca_encoder *ca)
 	read_esds_desc_ext(extra_data.data(), ca->extra_data, false);
 }
 
+/* Takes the ADTS fields from AudioSpecificConfig. HE-AAC is signaled implicitly with the AAC-LC core. */
+static bool adts_config_from_asc(const vector<uint8_t> &asc, adts_config &cfg)
+{
+	size_t pos = 0;
+	auto bits = [&asc, &pos](int n) {
+		uint32_t v = 0;
+		for (int i = 0; i < n; i++, pos++) {
+			uint8_t byte = pos / 8 < asc.size() ? asc[pos / 8] : 0;
+			v = v << 1 | ((byte >> (7 - pos % 8)) & 1);
+		}
+		return v;
+	};
+
+	if (asc.size() < 2)
+		return false;
+
+	uint32_t object_type = bits(5);
+	uint32_t samplerate_index = bits(4);
+	uint32_t channel_config = bits(4);
+	if (object_type == 5 || object_type == 29) {
+		// Explicit SBR signaling, the core follows the extension sample rate.
+		if (bits(4) == 15)
+			bits(24);
+		object_type = bits(5);
+	}
+
+	// An explicit sample rate (index 15) cannot be expressed in ADTS.
+	if (object_type < 1 || object_type > 4 || samplerate_index >= 15 || channel_config > 7)
+		return false;
+
+	cfg.profile = (uint8_t)(object_type - 1);
+	cfg.samplerate_index = (uint8_t)samplerate_index;
+	cfg.channel_config = (uint8_t)channel_config;
+	return true;
+}
+
+static void adts_header(const adts_config &cfg, uint32_t payload_size, uint8_t *header)
+{
+	uint32_t frame_length = payload_size + ADTS_HEADER_SIZE;
+
+	header[0] = 0xFF;
+	header[1] = 0xF1; // MPEG-4, no CRC
+	header[2] = (uint8_t)(cfg.profile << 6 | cfg.samplerate_index << 2 | cfg.channel_config >> 2);
+	header[3] = (uint8_t)((cfg.channel_config & 3) << 6 | frame_length >> 11);
+	header[4] = (uint8_t)(frame_length >> 3);
+	header[5] = (uint8_t)((frame_length & 7) << 5 | 0x1F); // Buffer fullness 0x7FF for VBR
+	header[6] = 0xFC;
+}
+
 static asbd_builder fill_common_asbd_fields(asbd_builder builder, bool in = false, UInt32 channels = 2)
 {
 	UInt32 bytes_per_frame = sizeof(float) * channels;
@@ -1026,151 +1681,777 @@ static const initializer_list<UInt32> &get_allowed_formats(const struct encoder_
 		return aac_lc_formats;
 }
 
-static void list_properties(struct encoder_settings *settings)
+static void print_json_string(const char *str)
 {
-	DStr log;
-	auto samplerates = get_samplerates(log, get_allowed_formats(settings));
-	printf("\"samplerates\": [");
-	for (size_t i = 0; i < samplerates.size(); i++)
-		printf("%s%u", i ? ", " : "", samplerates[i]);
-	printf("],\n");
-
-	auto bitrates = get_bitrates(log, settings);
-	printf("\"bitrates\": [");
-	for (size_t i = 0; i < bitrates.size(); i++)
-		printf("%s%u", i ? ", " : "", bitrates[i]);
-	printf("]\n");
+	putchar('"');
+	for (const char *p = str; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			putchar('\\');
+		putchar(*p);
+	}
+	putchar('"');
 }
 
-static bool write_header_data(const encoder_data_header &header, const uint8_t *data)
+/* Identifies the DLL so that the plugin can tell whether its cached capabilities are still valid. */
+static void list_dll_info()
 {
-	if (fwrite(&header, sizeof(header), 1, stdout) != 1) {
-		CA_LOG(LOG_ERROR, "Failed to write packet header to stdout");
-		return false;
-	}
+	char path[MAX_PATH] = "";
+	uint64_t size = 0;
+	int64_t mtime = 0;
 
-	if (header.size && fwrite(data, header.size, 1, stdout) != 1) {
-		CA_LOG(LOG_ERROR, "Failed to write packet header to stdout");
-		return false;
+#ifdef _WIN32
+	GetModuleFileNameA(audio_toolbox, path, MAX_PATH);
+
+	WIN32_FILE_ATTRIBUTE_DATA attr = {0};
+	if (GetFileAttributesExA(path, GetFileExInfoStandard, &attr)) {
+		size = (uint64_t)attr.nFileSizeHigh << 32 | attr.nFileSizeLow;
+		uint64_t ft = (uint64_t)attr.ftLastWriteTime.dwHighDateTime << 32 | attr.ftLastWriteTime.dwLowDateTime;
+		// FILETIME counts 100-ns intervals since 1601-01-01
+		mtime = (int64_t)(ft / 10000000) - 11644473600LL;
 	}
+#endif
 
-	fflush(stdout);
+	printf("\"dll\": {\"path\": ");
+	print_json_string(path);
+	printf(", \"size\": %llu, \"mtime\": %lld}", (unsigned long long)size, (long long)mtime);
+}
+
+static void list_format(DStr &log, bool allow_he_aac)
+{
+	struct encoder_settings settings = {};
+	settings.channels = 2;
+	settings.flags = allow_he_aac ? ENCODER_FLAG_ALLOW_HE_AAC : 0;
+
+	auto samplerates = get_samplerates(log, get_allowed_formats(&settings));
+	sort(begin(samplerates), end(samplerates));
+
+	printf("{\"he-aac\": %s, \"samplerates\": [", allow_he_aac ? "true" : "false");
+	for (size_t i = 0; i < samplerates.size(); i++) {
+		settings.samplerate_out = samplerates[i];
+		auto bitrates = get_bitrates(log, &settings);
+		sort(begin(bitrates), end(bitrates));
+
+		printf("%s\n{\"samplerate\": %u, \"bitrates\": [", i ? "," : "", (uint32_t)samplerates[i]);
+		for (size_t j = 0; j < bitrates.size(); j++)
+			printf("%s{\"bitrate\": %u}", j ? ", " : "", (uint32_t)bitrates[j]);
+		printf("]}");
+	}
+	printf("]}");
+}
+
+/* Prints the capabilities as a JSON object.
+ * Lists are arrays of objects so that they can be parsed by obs_data. */
+static void list_properties()
+{
+	DStr log;
+
+	printf("{\n");
+	list_dll_info();
+	printf(",\n\"formats\": [\n");
+	list_format(log, true);
+	printf(",\n");
+	list_format(log, false);
+	printf("\n]\n}\n");
+	fflush(stdout);
+}
+
+static bool map_shm(ca_encoder *ca, const char *unix_path)
+{
+	// The settings come from the pipe, so the path may lack its terminator.
+	const size_t path_len = strnlen(unix_path, ENCODER_SHM_PATH_MAX);
+	if (path_len == ENCODER_SHM_PATH_MAX) {
+		CA_LOG(LOG_ERROR, "Shared memory path is not terminated");
+		return false;
+	}
+
+	uint64_t file_size = 0;
+#ifdef _WIN32
+	// Wine exposes the Unix root directory as the drive Z:
+	string path = "Z:";
+	for (size_t i = 0; i < path_len; i++)
+		path += unix_path[i] == '/' ? '\\' : unix_path[i];
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+				  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+				  FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		CA_LOG(LOG_ERROR, "Failed to open shared memory '%s': %lu", path.c_str(), GetLastError());
+		return false;
+	}
 
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart < ENCODER_SHM_DATA_OFFSET) {
+		CA_LOG(LOG_ERROR, "Shared memory '%s' is too small", path.c_str());
+		CloseHandle(file);
+		return false;
+	}
+	file_size = (uint64_t)size.QuadPart;
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping) {
+		CA_LOG(LOG_ERROR, "Failed to create file mapping for '%s': %lu", path.c_str(), GetLastError());
+		return false;
+	}
+
+	ca->shm_view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!ca->shm_view) {
+		CA_LOG(LOG_ERROR, "Failed to map '%s': %lu", path.c_str(), GetLastError());
+		return false;
+	}
+#else
+	(void)ca;
+	CA_LOG(LOG_ERROR, "Shared memory '%s' is not supported on this platform", unix_path);
+	return false;
+#endif
+
+	// The ring and the arena have to be inside the mapped file.
+	auto *shm = static_cast<struct encoder_shm_header *>(ca->shm_view);
+	const uint64_t required_size = (uint64_t)ENCODER_SHM_DATA_OFFSET + shm->ring_size + shm->arena_size;
+	if (shm->struct_size != sizeof(*shm) || !shm->ring_size || (shm->ring_size & (shm->ring_size - 1)) ||
+	    (shm->arena_size & (shm->arena_size - 1)) || required_size > file_size) {
+		CA_LOG(LOG_ERROR, "Invalid shared memory header");
+#ifdef _WIN32
+		UnmapViewOfFile(ca->shm_view);
+#endif
+		ca->shm_view = nullptr;
+		return false;
+	}
+
+	ca->shm = shm;
+	ca->shm_data = static_cast<const uint8_t *>(ca->shm_view) + ENCODER_SHM_DATA_OFFSET;
+	ca->shm_read_pos = shm->read_pos;
+	if (shm->arena_size) {
+		ca->arena = static_cast<uint8_t *>(ca->shm_view) + ENCODER_SHM_DATA_OFFSET + shm->ring_size;
+		ca->arena_write_pos = shm->arena_read_pos;
+	}
 	return true;
 }
 
-static inline int main_internal(int argc, char **argv)
+static const uint8_t *shm_peek(ca_encoder *ca, uint32_t size)
 {
-	for (int i = 1; i < argc; i++) {
-		char *ai = argv[i];
-		if (ai[0] == '-') {
-			char c;
-			while (c = *++ai) {
-				switch (c) {
-				case 'l':
-					list_properties(nullptr);
-					return 0;
-				default:
-					fprintf(stderr, "Error: Unknown option '%c'\n", c);
-					return 1;
-				}
-			}
+	if (!ca->shm || size > ca->shm->ring_size)
+		return nullptr;
+
+	uint32_t offset = ca->shm_read_pos & (ca->shm->ring_size - 1);
+	if (offset + size <= ca->shm->ring_size)
+		return ca->shm_data + offset;
+
+	// The data wraps around the end of the ring.
+	uint32_t n = ca->shm->ring_size - offset;
+	ca->shm_buffer.resize(size);
+	memcpy(ca->shm_buffer.data(), ca->shm_data + offset, n);
+	memcpy(ca->shm_buffer.data() + n, ca->shm_data, size - n);
+	return ca->shm_buffer.data();
+}
+
+static void shm_consume(ca_encoder *ca, uint32_t size)
+{
+	ca->shm_read_pos += size;
+#ifdef _MSC_VER
+	ca->shm->read_pos = ca->shm_read_pos;
+#else
+	__atomic_store_n(&ca->shm->read_pos, ca->shm_read_pos, __ATOMIC_RELEASE);
+#endif
+}
+
+/*
+ * Requests and replies bypass stdio, which costs several translated calls per packet under Wine.
+ * The replies to a request are gathered and written with a single call.
+ */
+#ifdef _WIN32
+static HANDLE stdin_handle = INVALID_HANDLE_VALUE;
+static HANDLE stdout_handle = INVALID_HANDLE_VALUE;
+#endif
+static vector<uint8_t> reply_buffer;
+
+static void init_std_io()
+{
+#ifdef _WIN32
+	stdin_handle = GetStdHandle(STD_INPUT_HANDLE);
+	stdout_handle = GetStdHandle(STD_OUTPUT_HANDLE);
+#else
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+}
+
+static bool read_stdin(void *buffer, size_t size)
+{
+#ifdef _WIN32
+	auto *ptr = static_cast<uint8_t *>(buffer);
+	while (size) {
+		DWORD n = 0;
+		if (!ReadFile(stdin_handle, ptr, (DWORD)size, &n, NULL) || !n)
+			return false;
+		ptr += n;
+		size -= n;
+	}
+	return true;
+#else
+	return fread(buffer, size, 1, stdin) == 1;
+#endif
+}
+
+static void queue_output(const void *data, size_t size)
+{
+	const uint8_t *ptr = static_cast<const uint8_t *>(data);
+	reply_buffer.insert(reply_buffer.end(), ptr, ptr + size);
+}
+
+static void queue_reply(const encoder_data_header &header, const uint8_t *data)
+{
+	queue_output(&header, sizeof(header));
+	if (header.size && !(header.flags & ENCODER_FLAG_SHM))
+		queue_output(data, header.size);
+}
+
+static void queue_packet(const ca_encoder *ca, const encoded_packet &pkt)
+{
+	if (ca->adts) {
+		uint8_t adts_data[ADTS_HEADER_SIZE];
+		adts_header(ca->adts_cfg, pkt.size, adts_data);
+		queue_output(adts_data, sizeof(adts_data));
+	}
+	queue_output(pkt.data, pkt.size);
+}
+
+static bool flush_output()
+{
+	const uint8_t *ptr = reply_buffer.data();
+	size_t size = reply_buffer.size();
+	bool ok = true;
+
+#ifdef _WIN32
+	while (size) {
+		DWORD n = 0;
+		if (!WriteFile(stdout_handle, ptr, (DWORD)size, &n, NULL)) {
+			CA_LOG(LOG_ERROR, "Failed to write %zu bytes to stdout: %lu", size, GetLastError());
+			ok = false;
+			break;
+		}
+		ptr += n;
+		size -= n;
+	}
+#else
+	if (size && fwrite(ptr, size, 1, stdout) != 1) {
+		CA_LOG(LOG_ERROR, "Failed to write %zu bytes to stdout", size);
+		ok = false;
+	}
+	fflush(stdout);
+#endif
+
+	reply_buffer.clear();
+	return ok;
+}
+
+/* 'flags' is added to each reply. */
+static void queue_packets(const ca_encoder *ca, const vector<encoded_packet> &packets, uint32_t flags = 0)
+{
+	encoder_data_header header = {
+		.size = 0,
+		.frames = 0,
+		.pts = 0,
+		.flags = ENCODER_FLAG_QUERY_ENCODE | flags,
+		.stream_id = ca->stream_id,
+	};
+
+	if (!packets.size()) {
+		queue_reply(header, nullptr);
+		return;
+	}
+
+	for (size_t i = 0; i < packets.size(); i++) {
+		header.size = packets[i].size + (ca->adts ? ADTS_HEADER_SIZE : 0);
+		header.frames = (uint32_t)(packets.size() - i - 1);
+		header.pts = packets[i].pts;
+		header.flags = ENCODER_FLAG_QUERY_ENCODE | flags | packets[i].flags;
+		queue_output(&header, sizeof(header));
+		if (!(header.flags & ENCODER_FLAG_SHM))
+			queue_packet(ca, packets[i]);
+	}
+}
+
+static bool null_encoder_mode = false;
+
+static ca_encoder *create_instance(struct encoder_settings *settings)
+{
+	if (settings->struct_size != sizeof(*settings)) {
+		CA_LOG(LOG_ERROR, "struct_size mismatch, got %u, expected %zu", settings->struct_size,
+		       sizeof(*settings));
+		return nullptr;
+	}
+
+	if (settings->proc_version != ENCODER_PROC_VERSION) {
+		CA_LOG(LOG_ERROR, "Protocol version mismatch, got %u, expected %u", settings->proc_version,
+		       ENCODER_PROC_VERSION);
+		return nullptr;
+	}
+
+	struct ca_encoder *ca = null_encoder_mode ? null_create(settings) : aac_create(settings);
+	if (!ca)
+		return nullptr;
+
+	if ((settings->flags & ENCODER_FLAG_SHM) && !map_shm(ca, settings->shm_path))
+		settings->flags &= ~ENCODER_FLAG_SHM;
+
+	if (!ca->null_encoder)
+		query_extra_data(ca);
+	settings->extra_data_size = 0;
+	if (ca->extra_data.size() <= sizeof(settings->extra_data)) {
+		memcpy(settings->extra_data, ca->extra_data.data(), ca->extra_data.size());
+		settings->extra_data_size = (uint32_t)ca->extra_data.size();
+	}
+
+	if ((settings->flags & ENCODER_FLAG_ADTS) && !adts_config_from_asc(ca->extra_data, ca->adts_cfg)) {
+		CA_LOG(LOG_WARNING, "The format cannot be written as ADTS");
+		settings->flags &= ~ENCODER_FLAG_ADTS;
+	}
+	ca->adts = (settings->flags & ENCODER_FLAG_ADTS) != 0;
+
+	/* All streams share the thread, so the priority is raised once and kept. */
+	static bool high_priority = false;
+	if ((settings->flags & ENCODER_FLAG_HIGH_PRIORITY) && !high_priority) {
+		if (SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+			high_priority = true;
+		else
+			CA_LOG(LOG_WARNING, "Failed to raise the thread priority");
+	}
+
+	settings->out_frames_per_packet = (uint32_t)ca->out_frames_per_packet;
+	settings->priming_frames = ca->priming_samples;
+
+	return ca;
+}
+
+static bool read_request_data(ca_encoder *ca, const encoder_data_header &header, vector<uint8_t> &payload,
+			      const uint8_t **data)
+{
+	if (header.flags & ENCODER_FLAG_SHM) {
+		*data = ca ? shm_peek(ca, header.size) : nullptr;
+		if (ca && !*data) {
+			CA_LOG(LOG_ERROR, "Invalid shared memory request of %u bytes", header.size);
+			return false;
+		}
+		return true;
+	}
+
+	if (header.size > ENCODER_REQUEST_SIZE_MAX) {
+		CA_LOG(LOG_ERROR, "Request of %u bytes exceeds the limit", header.size);
+		return false;
+	}
+
+	payload.resize(header.size);
+	if (header.size && !read_stdin(payload.data(), header.size)) {
+		CA_LOG(LOG_ERROR, "Failed to read payload from stdin");
+		return false;
+	}
+	*data = payload.data();
+	return true;
+}
+
+/* Applied between two calls of AudioConverterFillComplexBuffer, so the next packet is the first one at the new
+ * bitrate. The samples already buffered are encoded at the new bitrate. */
+static bool set_bitrate(ca_encoder *ca, UInt32 bitrate)
+{
+	bool valid = false;
+	for (const auto &range : ca->bitrate_ranges)
+		valid = valid || (range.first <= bitrate && bitrate <= range.second);
+	if (!valid) {
+		CA_LOG(LOG_ERROR, "Encoder does not support bitrate %u", (uint32_t)bitrate);
+		return false;
+	}
+
+	if (ca->null_encoder) {
+		CA_LOG(LOG_INFO, "Bitrate changed from %u to %u bps", (uint32_t)ca->bitrate, (uint32_t)bitrate);
+		ca->bitrate = bitrate;
+		ca->null_packet_bytes = null_packet_size(bitrate, ca->samples_per_second);
+		return true;
+	}
+
+	OSStatus code =
+		AudioConverterSetProperty(ca->converter, kAudioConverterEncodeBitRate, sizeof(bitrate), &bitrate);
+	if (code) {
+		log_osstatus(LOG_ERROR, ca, "AudioConverterSetProperty(EncodeBitRate)", code);
+		return false;
+	}
+
+	/* The buffers were sized for the limit of AAC, so a larger packet is not expected here. */
+	UInt32 max_packet_size = 0;
+	UInt32 size = sizeof(max_packet_size);
+	code = AudioConverterGetProperty(ca->converter, kAudioConverterPropertyMaximumOutputPacketSize, &size,
+					 &max_packet_size);
+	if (!code && max_packet_size > ca->output_buffer_size) {
+		try {
+			ca->output_buffer.resize(max_packet_size * ca->output_packets);
+		} catch (...) {
+			CA_LOG(LOG_ERROR, "Failed to allocate buffers for packets of %u bytes",
+			       (uint32_t)max_packet_size);
+			AudioConverterSetProperty(ca->converter, kAudioConverterEncodeBitRate, sizeof(ca->bitrate),
+						  &ca->bitrate);
+			return false;
+		}
+		ca->output_buffer_size = max_packet_size;
+	}
+
+	CA_LOG(LOG_INFO, "Bitrate changed from %u to %u bps", (uint32_t)ca->bitrate, (uint32_t)bitrate);
+	ca->bitrate = bitrate;
+	return true;
+}
+
+static bool handle_request(ca_encoder *ca, const encoder_data_header &header, const uint8_t *data)
+{
+	if (header.flags & ENCODER_FLAG_SET_BITRATE) {
+		uint32_t bitrate = 0;
+		bool ok = false;
+		if (header.size == sizeof(bitrate)) {
+			memcpy(&bitrate, data, sizeof(bitrate));
+			ok = set_bitrate(ca, bitrate);
 		}
 		else {
-			fprintf(stderr, "Error: Unknown argument '%s'\n", ai);
-			return 1;
+			CA_LOG(LOG_ERROR, "Bitrate request has %u bytes instead of %zu", header.size, sizeof(bitrate));
 		}
+		encoder_data_header reply = {
+			.size = ok ? (uint32_t)sizeof(bitrate) : 0,
+			.frames = 0,
+			.pts = 0,
+			.flags = ENCODER_FLAG_SET_BITRATE,
+			.stream_id = ca->stream_id,
+		};
+		queue_reply(reply, (const uint8_t *)&bitrate);
+		return flush_output();
 	}
 
-	_setmode(_fileno(stdin), _O_BINARY);
-	_setmode(_fileno(stdout), _O_BINARY);
+	// A rejected request is answered as usual so that the main process can tell that its audio was dropped.
+	bool encoded = true;
+	if (header.flags & ENCODER_FLAG_QUERY_ENCODE)
+		encoded = aac_encode(ca, &header, data, ca->packets);
+	else if (header.flags & ENCODER_FLAG_FLUSH) {
+		ca->packets.clear();
+		ca->output_used = 0;
+	}
+
+	if ((header.flags & ENCODER_FLAG_FLUSH) && !aac_flush(ca, ca->packets))
+		encoded = false;
+
+	if (header.flags & (ENCODER_FLAG_QUERY_ENCODE | ENCODER_FLAG_FLUSH)) {
+		const uint32_t flags = (header.flags & ENCODER_FLAG_FLUSH) | (encoded ? 0 : ENCODER_FLAG_ERROR);
+		queue_packets(ca, ca->packets, flags);
+	}
+
+	if (header.flags & ENCODER_FLAG_QUERY_EXTRA_DATA) {
+		if (!ca->extra_data.size())
+			query_extra_data(ca);
+		encoder_data_header reply = {
+			.size = (uint32_t)ca->extra_data.size(),
+			.frames = 0,
+			.pts = 0,
+			.flags = ENCODER_FLAG_QUERY_EXTRA_DATA,
+			.stream_id = ca->stream_id,
+		};
+		queue_reply(reply, ca->extra_data.data());
+	}
+
+	if (header.flags & ENCODER_FLAG_QUERY_STATS) {
+		ca->stats.peak_working_set = get_peak_working_set();
+		encoder_data_header reply = {
+			.size = sizeof(ca->stats),
+			.frames = 0,
+			.pts = 0,
+			.flags = ENCODER_FLAG_QUERY_STATS,
+			.stream_id = ca->stream_id,
+		};
+		queue_reply(reply, (const uint8_t *)&ca->stats);
+	}
+
+	if (header.flags & ENCODER_FLAG_SHM)
+		shm_consume(ca, header.size);
+
+	return flush_output();
+}
+
+static size_t read_stdin_some(void *buffer, size_t size)
+{
+	size_t total = 0;
+#ifdef _WIN32
+	auto *ptr = static_cast<uint8_t *>(buffer);
+	while (total < size) {
+		DWORD n = 0;
+		if (!ReadFile(stdin_handle, ptr + total, (DWORD)(size - total), &n, NULL) || !n)
+			break;
+		total += n;
+	}
+#else
+	total = fread(buffer, 1, size, stdin);
+#endif
+	return total;
+}
 
+#define TRANSCODE_CHUNK_FRAMES 65536
+
+/*
+ * Encodes a file as fast as the encoder allows (option '-t').
+ * stdin has encoder_settings followed by interleaved PCM data until the end of the file.
+ * stdout receives the ADTS stream, which ends with the packet that covers the last input sample.
+ */
+static int run_transcode()
+{
 	struct encoder_settings settings;
 
-	if (fread(&settings, sizeof(settings), 1, stdin) != 1) {
+	if (!read_stdin(&settings, sizeof(settings))) {
 		CA_LOG(LOG_ERROR, "Failed to read settings from stdin");
 		return 1;
 	}
+	settings.flags &= ~(ENCODER_FLAG_SHM | ENCODER_FLAG_PLANAR);
+	settings.flags |= ENCODER_FLAG_ADTS;
 
-	if (settings.struct_size != sizeof(settings)) {
-		CA_LOG(LOG_ERROR, "struct_size mismatch, got %u, expected %zu", settings.struct_size, sizeof(settings));
+	struct ca_encoder *ca = create_instance(&settings);
+	if (!ca) {
+		CA_LOG(LOG_ERROR, "Failed to create the instance");
 		return 1;
 	}
 
-	if (settings.proc_version != ENCODER_PROC_VERSION) {
-		CA_LOG(LOG_ERROR, "Protocol version mismatch, got %u, expected %u", settings.proc_version,
-		       ENCODER_PROC_VERSION);
+	if (!ca->adts) {
+		aac_destroy(ca);
 		return 1;
 	}
 
-	struct ca_encoder *ca = aac_create(&settings);
-	if (!ca) {
-		CA_LOG(LOG_ERROR, "Failed to create the instance");
+	vector<uint8_t> chunk;
+	try {
+		chunk.resize(TRANSCODE_CHUNK_FRAMES * ca->in_frame_size);
+	} catch (...) {
+		CA_LOG(LOG_ERROR, "Failed to allocate the input buffer");
+		aac_destroy(ca);
 		return 1;
 	}
 
-	settings.out_frames_per_packet = (uint32_t)ca->out_frames_per_packet;
+	uint64_t packets = 0;
+	bool eof = false;
+	int ret = 0;
+	const uint64_t start_us = get_time_us();
+
+	// At the end of the input, the flush encodes the tail and ends the output with the last sample.
+	while (!eof) {
+		size_t size = read_stdin_some(chunk.data(), chunk.size());
+		eof = size < chunk.size();
+		size -= size % ca->in_frame_size;
+
+		encoder_data_header header = {
+			.size = (uint32_t)size,
+			.frames = 1,
+			.pts = 0,
+			.flags = ENCODER_FLAG_QUERY_ENCODE,
+			.stream_id = 0,
+		};
+		if (!aac_encode(ca, &header, chunk.data(), ca->packets) || (eof && !aac_flush(ca, ca->packets))) {
+			ret = 1;
+			break;
+		}
+
+		for (const encoded_packet &pkt : ca->packets) {
+			queue_packet(ca, pkt);
+			packets++;
+		}
+
+		if (!flush_output()) {
+			ret = 1;
+			break;
+		}
+	}
+
+	double elapsed = (get_time_us() - start_us) * 1e-6;
+	CA_LOG(LOG_INFO, "Transcoded %llu samples into %llu packets in %.2f s", (unsigned long long)ca->samples_in,
+	       (unsigned long long)packets, elapsed);
+
+	aac_destroy(ca);
+
+	return ret;
+}
+
+static int run_single()
+{
+	struct encoder_settings settings;
+
+	if (!read_stdin(&settings, sizeof(settings))) {
+		CA_LOG(LOG_ERROR, "Failed to read settings from stdin");
+		return 1;
+	}
 
-	if (fwrite(&settings, sizeof(settings), 1, stdout) != 1) {
-		CA_LOG(LOG_ERROR, "Failed to write settings to stdout");
+	struct ca_encoder *ca = create_instance(&settings);
+	if (!ca) {
+		CA_LOG(LOG_ERROR, "Failed to create the instance");
 		return 1;
 	}
 
-	fflush(stdout);
+	queue_output(&settings, sizeof(settings));
+	if (!flush_output())
+		return 1;
 
 	encoder_data_header header;
 	vector<uint8_t> payload;
 	for (header.flags = 0; (header.flags & ENCODER_FLAG_EXIT) == 0;) {
-		if (fread(&header, sizeof(header), 1, stdin) != 1)
+		if (!read_stdin(&header, sizeof(header)))
 			break;
 
-		payload.resize(header.size);
-		if (header.size && fread(payload.data(), header.size, 1, stdin) != 1) {
-			CA_LOG(LOG_ERROR, "Failed to read payload from stdin");
+		const uint8_t *data = nullptr;
+		if (!read_request_data(ca, header, payload, &data))
 			break;
-		}
 
-		if (header.flags & ENCODER_FLAG_QUERY_ENCODE) {
-			encoder_data_header packet_header = {
-				.size = 0,
-				.flags = ENCODER_FLAG_QUERY_ENCODE,
-			};
-			uint8_t *packet_data = nullptr;
-			bool encode_res = aac_encode(ca, &header, payload.data(), &packet_header, &packet_data);
+		if (!handle_request(ca, header, data))
+			break;
+	}
+
+	aac_destroy(ca);
+
+	return 0;
+}
 
-			if (!write_header_data(packet_header, packet_data))
+static bool create_stream(map<uint32_t, ca_encoder *> &encoders, const encoder_data_header &header)
+{
+	struct encoder_settings settings;
+
+	if (header.size != sizeof(settings)) {
+		CA_LOG(LOG_ERROR, "Settings size mismatch, got %u, expected %zu", header.size, sizeof(settings));
+		return false;
+	}
+
+	if (!read_stdin(&settings, sizeof(settings))) {
+		CA_LOG(LOG_ERROR, "Failed to read settings from stdin");
+		return false;
+	}
+
+	ca_encoder *ca = nullptr;
+	if (encoders.count(header.stream_id))
+		CA_LOG(LOG_ERROR, "Stream %u already exists", header.stream_id);
+	else
+		ca = create_instance(&settings);
+
+	if (ca) {
+		ca->stream_id = header.stream_id;
+		encoders[header.stream_id] = ca;
+	}
+	else {
+		CA_LOG(LOG_ERROR, "Failed to create the instance for stream %u", header.stream_id);
+	}
+
+	encoder_data_header reply = {
+		.size = ca ? (uint32_t)sizeof(settings) : 0,
+		.frames = 0,
+		.pts = 0,
+		.flags = ENCODER_FLAG_CREATE,
+		.stream_id = header.stream_id,
+	};
+	queue_reply(reply, (const uint8_t *)&settings);
+	return flush_output();
+}
+
+/*
+ * Serves many encoder instances in one process.
+ * Each request is addressed by 'stream_id' and the process exits when stdin is closed.
+ */
+static int run_server()
+{
+	map<uint32_t, ca_encoder *> encoders;
+
+	encoder_data_header header;
+	vector<uint8_t> payload;
+	while (read_stdin(&header, sizeof(header))) {
+		if (header.flags & ENCODER_FLAG_CREATE) {
+			if (!create_stream(encoders, header))
 				break;
+			continue;
 		}
 
-		if (header.flags & ENCODER_FLAG_QUERY_EXTRA_DATA) {
-			if (!ca->extra_data.size())
-				query_extra_data(ca);
-			encoder_data_header header = {
-				.size = ca->extra_data.size(),
-				.flags = ENCODER_FLAG_QUERY_EXTRA_DATA,
-			};
-			if (!write_header_data(header, ca->extra_data.data()))
-				break;
+		auto it = encoders.find(header.stream_id);
+		ca_encoder *ca = it != encoders.end() ? it->second : nullptr;
+
+		const uint8_t *data = nullptr;
+		if (!read_request_data(ca, header, payload, &data))
+			break;
+
+		if (!ca) {
+			CA_LOG(LOG_ERROR, "Unknown stream %u", header.stream_id);
+			continue;
+		}
+
+		if (!handle_request(ca, header, data))
+			break;
+
+		if (header.flags & ENCODER_FLAG_EXIT) {
+			aac_destroy(ca);
+			encoders.erase(it);
 		}
 	}
 
-	aac_destroy(ca);
+	for (auto &it : encoders)
+		aac_destroy(it.second);
 
 	return 0;
 }
 
-int main(int argc, char **argv)
+static inline int main_internal(int argc, char **argv)
 {
+	bool list = false;
+	bool server = false;
+	bool transcode = false;
+
+	for (int i = 1; i < argc; i++) {
+		char *ai = argv[i];
+		if (ai[0] == '-') {
+			char c;
+			while (c = *++ai) {
+				switch (c) {
+				case 'l':
+					list = true;
+					break;
+				case 'n':
+					null_encoder_mode = true;
+					break;
+				case 's':
+					server = true;
+					break;
+				case 't':
+					transcode = true;
+					break;
+				default:
+					fprintf(stderr, "Error: Unknown option '%c'\n", c);
+					return 1;
+				}
+			}
+		}
+		else {
+			fprintf(stderr, "Error: Unknown argument '%s'\n", ai);
+			return 1;
+		}
+	}
+
 #ifdef _WIN32
-	if (!load_core_audio()) {
+	if (!null_encoder_mode && !load_core_audio()) {
 		CA_LOG(LOG_WARNING, "CoreAudio AAC encoder not installed on "
 				    "the system or couldn't be loaded");
 		return 1;
 	}
 
-	CA_LOG(LOG_INFO, "Adding CoreAudio AAC encoder");
+	if (!null_encoder_mode)
+		CA_LOG(LOG_INFO, "Adding CoreAudio AAC encoder");
 #endif
 
+	if (list) {
+		list_properties();
+		return 0;
+	}
+
+	init_std_io();
+
+	if (transcode)
+		return run_transcode();
+
+	return server ? run_server() : run_single();
+}
+
+int main(int argc, char **argv)
+{
 	int ret = main_internal(argc, argv);
 
 #ifdef _WIN32
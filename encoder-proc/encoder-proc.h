@@ -18,7 +18,9 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
+#include "histogram.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -28,6 +30,30 @@ extern "C" {
 #define ENCODER_FLAG_QUERY_ENCODE (1 << 1)
 #define ENCODER_FLAG_QUERY_EXTRA_DATA (1 << 2)
 #define ENCODER_FLAG_EXIT (1 << 3)
+#define ENCODER_FLAG_SHM (1 << 4) // PCM data is in the shared-memory ring instead of the pipe
+#define ENCODER_FLAG_CREATE (1 << 5) // Server mode only, the payload is encoder_settings
+#define ENCODER_FLAG_QUERY_STATS (1 << 6) // Answered with encoder_stats
+#define ENCODER_FLAG_PLANAR (1 << 7) // Settings only, PCM data is non-interleaved
+#define ENCODER_FLAG_S16 (1 << 8)    // Settings only, PCM data is signed 16-bit instead of float
+#define ENCODER_FLAG_SHM_WRAP (1 << 9)       // Reply only, the packet starts at the top of the packet arena
+#define ENCODER_FLAG_REMAPPED (1 << 10)      // Settings only, channels are already in the order of the encoder
+#define ENCODER_FLAG_ADTS (1 << 11)          // Settings only, each packet starts with an ADTS header
+#define ENCODER_FLAG_HIGH_PRIORITY (1 << 12) // Settings only, runs the encoding thread at time-critical priority
+#define ENCODER_FLAG_SET_BITRATE (1 << 13)   // The payload is the new bitrate as uint32_t
+#define ENCODER_FLAG_FLUSH (1 << 14)         // Encodes the rest of the input and ends the stream
+#define ENCODER_FLAG_ERROR (1 << 15)         // Reply only, the request failed and its audio was dropped
+
+// Same values as kAudioConverterQuality_* and kAudioCodecBitRateControlMode_*
+#define ENCODER_QUALITY_MAX 0x7F
+#define ENCODER_RATE_CONTROL_CBR 0
+#define ENCODER_RATE_CONTROL_ABR 1
+#define ENCODER_RATE_CONTROL_VBR_CONSTRAINED 2
+
+#define ENCODER_SHM_PATH_MAX 128
+#define ENCODER_EXTRA_DATA_MAX 64
+#define ENCODER_SHM_DATA_OFFSET 64
+#define ENCODER_REQUEST_SIZE_MAX (16 << 20) // Larger payloads in the pipe are rejected as malformed
+#define ENCODER_FRAMES_PER_REQUEST_MAX 64 // Frames of out_frames_per_packet samples in one encode request
 
 struct encoder_settings
 {
@@ -41,9 +67,77 @@ struct encoder_settings
 	uint32_t samplerate_in;
 	uint32_t samplerate_out; // 0 to match samplerate_in
 	uint32_t flags;
+	char shm_path[ENCODER_SHM_PATH_MAX]; // Unix path, valid if ENCODER_FLAG_SHM is set
+	uint32_t quality;                    // From 0 to ENCODER_QUALITY_MAX, higher takes more CPU time
+	uint32_t rate_control;               // ENCODER_RATE_CONTROL_*
 
 	// Set from the child process
 	uint32_t out_frames_per_packet;
+	uint32_t priming_frames; // The first packets have negative pts down to -priming_frames
+	uint32_t extra_data_size;
+	uint8_t extra_data[ENCODER_EXTRA_DATA_MAX]; // AudioSpecificConfig, empty if it was not available
+};
+
+/*
+ * Placed at the top of the shared-memory file.
+ * The ring buffer starts at ENCODER_SHM_DATA_OFFSET and has ring_size bytes, which is a power of 2.
+ * The main process writes PCM data at its own write position and then sends a header with ENCODER_FLAG_SHM.
+ * The child process consumes the data in the same order and advances read_pos.
+ *
+ * The packet arena follows the ring buffer and has arena_size bytes, which is 0 or a power of 2.
+ * The child process encodes directly into the arena and replies with ENCODER_FLAG_SHM and no payload.
+ * Each packet starts where the previous one ended, or at the top of the arena if ENCODER_FLAG_SHM_WRAP is set.
+ * The main process advances arena_read_pos past a packet once it is no longer used.
+ */
+struct encoder_shm_header
+{
+	uint32_t struct_size;
+	uint32_t ring_size;
+
+	// Written by the child process, byte count modulo 2^32
+	volatile uint32_t read_pos;
+
+	uint32_t arena_size;
+
+	// Written by the main process, byte count modulo 2^32
+	volatile uint32_t arena_read_pos;
+};
+
+/*
+ * A request with ENCODER_FLAG_QUERY_ENCODE carries 'frames' audio frames from OBS concatenated in the payload,
+ * and 'pts' is the timestamp of the first frame.
+ * The request is answered by one or more replies.
+ * Each reply carries one packet and its own pts, and 'frames' is the number of replies that follow.
+ * If no packet is available, a single reply with 'size' 0 is returned.
+ * If the request was rejected, or the encoder failed, every reply to it has ENCODER_FLAG_ERROR set.
+ * If ENCODER_FLAG_PLANAR was set at creation, each frame is stored as its planes one after another, and every
+ * frame of a request has the same number of samples.
+ *
+ * In the server mode (option '-s'), one process hosts many encoders.
+ * A request with ENCODER_FLAG_CREATE creates the encoder for 'stream_id' and is answered with the updated
+ * encoder_settings, or with 'size' 0 on failure. ENCODER_FLAG_EXIT destroys only that encoder.
+ *
+ * A request with ENCODER_FLAG_SET_BITRATE changes the bitrate of the running encoder from the next packet.
+ * It is answered with the bitrate that is now in effect, or with 'size' 0 if the bitrate was rejected.
+ *
+ * A request with ENCODER_FLAG_FLUSH encodes the input left in the buffer, padded with silence, and the delay of
+ * the encoder, and is answered like an encode request with ENCODER_FLAG_FLUSH added to each reply.
+ * If ENCODER_FLAG_QUERY_ENCODE is also set, the payload is encoded first and one set of replies carries both.
+ * The packets end with the last input sample, and later encode requests are rejected.
+ * Only the tools send it. OBS stops an encoder without draining it, so the plugin has no way to output the tail.
+ */
+/* Measured by the child process since the encoder was created. Durations are in microseconds. */
+struct encoder_stats
+{
+	uint32_t struct_size;
+	uint32_t input_buffer_max; // bytes
+
+	uint64_t frames;           // OBS frames received
+	uint64_t packets;          // packets produced
+	uint64_t peak_working_set; // bytes, of the whole process
+
+	struct encoder_histogram encode_us;    // time in AudioConverterFillComplexBuffer per request
+	struct encoder_histogram input_buffer; // bytes left in the input buffer after each request
 };
 
 struct encoder_data_header
@@ -52,8 +146,30 @@ struct encoder_data_header
 	uint32_t frames;
 	int64_t pts;
 	uint32_t flags;
+	uint32_t stream_id; // Used in the server mode, 0 otherwise
 };
 
+/*
+ * The plugin (64-bit Linux) and the child process (32-bit or 64-bit Windows) exchange these structures as raw
+ * bytes, so their layouts must not depend on the ABI.
+ */
+#ifdef __cplusplus
+#define ENCODER_STATIC_ASSERT(expr) static_assert(expr, #expr)
+#else
+#define ENCODER_STATIC_ASSERT(expr) _Static_assert(expr, #expr)
+#endif
+
+ENCODER_STATIC_ASSERT(sizeof(struct encoder_data_header) == 24);
+ENCODER_STATIC_ASSERT(offsetof(struct encoder_data_header, pts) == 8);
+ENCODER_STATIC_ASSERT(offsetof(struct encoder_data_header, stream_id) == 20);
+ENCODER_STATIC_ASSERT(sizeof(struct encoder_settings) == 240);
+ENCODER_STATIC_ASSERT(offsetof(struct encoder_settings, quality) == 156);
+ENCODER_STATIC_ASSERT(offsetof(struct encoder_settings, extra_data) == 176);
+ENCODER_STATIC_ASSERT(sizeof(struct encoder_shm_header) == 20);
+ENCODER_STATIC_ASSERT(sizeof(struct encoder_shm_header) <= ENCODER_SHM_DATA_OFFSET);
+ENCODER_STATIC_ASSERT(sizeof(struct encoder_stats) == 232);
+ENCODER_STATIC_ASSERT(offsetof(struct encoder_stats, encode_us) == 32);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2024 Norihiro Kamae <norihiro@nagater.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bucket 0 counts the value 0, bucket i counts values in [2^(i-1), 2^i), the last bucket counts the rest. */
+#define ENCODER_HISTOGRAM_BUCKETS 24
+
+struct encoder_histogram
+{
+	uint32_t count[ENCODER_HISTOGRAM_BUCKETS];
+	uint32_t max;
+};
+
+static inline void encoder_histogram_add(struct encoder_histogram *h, uint32_t value)
+{
+	uint32_t i = 0;
+	while (i < ENCODER_HISTOGRAM_BUCKETS - 1 && value >> i)
+		i++;
+
+	h->count[i]++;
+	if (value > h->max)
+		h->max = value;
+}
+
+static inline uint64_t encoder_histogram_total(const struct encoder_histogram *h)
+{
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < ENCODER_HISTOGRAM_BUCKETS; i++)
+		total += h->count[i];
+	return total;
+}
+
+/* Returns the upper bound of the bucket that contains the percentile, not exceeding the maximum. */
+static inline uint32_t encoder_histogram_percentile(const struct encoder_histogram *h, uint32_t percent)
+{
+	uint64_t total = encoder_histogram_total(h);
+	if (!total)
+		return 0;
+
+	uint64_t target = (total * percent + 99) / 100;
+	uint64_t sum = 0;
+	for (uint32_t i = 0; i < ENCODER_HISTOGRAM_BUCKETS; i++) {
+		sum += h->count[i];
+		if (sum >= target) {
+			uint32_t upper = i ? (uint32_t)((1ULL << i) - 1) : 0;
+			return upper < h->max ? upper : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -19,22 +19,59 @@
 
 #include <obs-module.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
 #include <cstdlib>
+#include <deque>
 #include <memory>
 #include <mutex>
+#include <set>
+#include <string>
 #include <vector>
-#include <thread>
+#include <cstring>
 #include <unistd.h>
-#include <sys/wait.h>
+#include <util/platform.h>
 #include <util/util.hpp>
 #include "plugin-macros.generated.h"
 #include "encoder-proc/encoder-proc.h"
 #include "encoder-proc/encoder-proc-version.h"
-#include "run-proc.h"
+#include "encoder-proc/channel-map.h"
+#include "co-process.hpp"
+#include "shm-ring.h"
+#include "capabilities.hpp"
+#include "pcm-convert.h"
+
+#define SHM_RING_SIZE (1 << 20)
+#define SHM_ARENA_SIZE (1 << 18)
+
+/* Starting Wine takes a few seconds if the process was not pre-started. */
+#define SETTINGS_TIMEOUT_MS 10000
+#define EXTRA_DATA_TIMEOUT_MS 1000
+/* The co-process is considered stalled if an encode request has no reply for this time. */
+#define ENCODE_STALL_TIMEOUT_NS 1000000000ULL
+/* A co-process failing again within this time after a restart is not restarted. */
+#define RESTART_INTERVAL_NS 10000000000ULL
+#define READER_EXIT_TIMEOUT_MS 1000
+#define STATS_INTERVAL_NS 60000000000ULL
+#define FREE_BUFFERS_MAX 8
 
 namespace {
 
-struct ca_encoder
+struct ca_packet
+{
+	int64_t pts;
+	std::vector<uint8_t> data;
+
+	/* Set instead of data if the packet is in the shared-memory arena */
+	const uint8_t *shm_data = nullptr;
+	uint32_t shm_size = 0;
+	uint32_t shm_end = 0;
+};
+
+struct ca_encoder : co_process_stream
 {
 	obs_encoder_t *encoder = nullptr;
 
@@ -42,118 +79,375 @@ struct ca_encoder
 
 	std::vector<uint8_t> encode_buffer;
 
-	uint64_t samples_per_second = 0;
+	/* Filled by the reader thread of the co-process, drained by aac_encode */
+	std::mutex packets_mutex;
+	std::condition_variable packets_cond;
+	std::deque<ca_packet> packets;
+	std::vector<std::vector<uint8_t>> free_buffers;
+	bool settings_received = false;
+	bool extra_data_received = false;
+	bool reader_eof = false;
+	/* Set if the co-process replied with ENCODER_FLAG_ERROR, the audio of that request is lost. */
+	bool request_failed = false;
+	struct encoder_settings created_settings = {};
+
+	/* Send time of each encode request without the last reply, and the time of the last progress */
+	std::deque<uint64_t> pending_requests;
+	uint64_t last_progress_ns = 0;
+
+	/* Statistics since the encoder was created */
+	struct encoder_histogram rtt_us = {};
+	uint64_t frames_sent = 0;
+	uint64_t packets_received = 0;
+	uint64_t bytes_sent = 0;
+	uint64_t bytes_received = 0;
+	uint64_t stats_start_ns = 0;
+	uint64_t next_stats_ns = 0;
+	struct encoder_stats proc_stats = {};
 
-	std::vector<uint8_t> extra_data;
+	uint64_t samples_per_second = 0;
 
-	pid_t pid = -1;
-	int fd_req = -1;
-	int fd_data = -1;
-	int fd_err = -1;
+	/* Frames waiting to be sent as one request */
+	uint32_t frames_per_request = 1;
+	struct encoder_data_header batch = {};
+	std::vector<uint8_t> batch_buffer;
 
-	std::thread stderr_thread;
+	std::vector<uint8_t> extra_data;
+	std::vector<uint8_t> received_extra_data;
+
+	std::shared_ptr<co_process> proc;
+	uint32_t stream_id = 0;
+
+	struct shm_ring shm = {};
+	bool use_shm = false;
+
+	/* The arena is released up to the packet returned by the last aac_encode call. */
+	bool holds_shm_packet = false;
+	uint32_t held_shm_end = 0;
+	bool allow_he_aac = false;
+	bool planar = false;
+	bool s16 = false;
+	std::vector<int16_t> convert_buffer;
+
+	/* Set if the channels are reordered here instead of in the encoder */
+	const encoder_channel_map *remap = nullptr;
+	std::vector<float> remap_buffer;
+
+	/* Kept to restart the co-process */
+	struct encoder_settings requested_settings = {};
+	bool request_shm = false;
+	bool request_adts = false;
+	bool shared_process = false;
+	struct run_proc_sched sched = {};
+
+	/* Set by aac_update and sent by aac_encode so that the requests stay in order with the frames. */
+	std::atomic<uint32_t> pending_bitrate = {0};
+	/* The bitrate confirmed by the co-process, used at a restart */
+	uint32_t applied_bitrate = 0;
+	/* The bitrate last accepted by aac_update, or the initial one */
+	uint32_t update_bitrate = 0;
+	uint64_t last_restart_ns = 0;
+
+	/* The co-process counts pts from zero. After a restart, pts_offset is the number of samples sent to the
+	 * previous processes. */
+	uint32_t in_frame_size = 0;
+	int64_t samples_sent = 0;
+	int64_t pts_offset = 0;
+	int64_t last_pts = 0;
+	bool has_last_pts = false;
+
+	/* Encoder delay from the co-process, the first packets have negative pts */
+	uint32_t priming_frames = 0;
 
 	~ca_encoder()
 	{
-		if (fd_req >= 0)
-			close(fd_req);
-		if (fd_data >= 0)
-			close(fd_data);
-
-		if (pid > 0) {
-			int wstatus = 0;
-			pid_t ret = waitpid(pid, &wstatus, 0);
-			if (ret == pid) {
-				blog(LOG_INFO, "[%s] process %d terminated", obs_encoder_get_name(encoder), (int)pid);
-				pid = -1;
-			}
+		if (stream_id && proc) {
+			struct encoder_data_header header = {
+				.size = 0,
+				.frames = 0,
+				.pts = 0,
+				.flags = ENCODER_FLAG_EXIT,
+				.stream_id = stream_id,
+			};
+			proc->write(header, nullptr, "exit");
+			proc->remove_stream(stream_id);
 		}
 
-		if (stderr_thread.joinable())
-			stderr_thread.join();
+		proc.reset();
 
-		if (fd_err >= 0)
-			close(fd_err);
+		if (shm.header)
+			shm_ring_destroy(&shm);
 	}
 
-	const char *name() const
+	const char *name() const override
 	{
 		if (encoder)
 			return obs_encoder_get_name(encoder);
 		else
 			return "";
 	}
-};
 
-} // namespace
+	void on_reply(const struct encoder_data_header &header, std::vector<uint8_t> &data) override
+	{
+		std::unique_lock<std::mutex> lock(packets_mutex);
 
-static void stderr_thread_routine(ca_encoder *ca)
-{
-	std::vector<char> buf;
+		if (header.flags & ENCODER_FLAG_CREATE) {
+			if (data.size() == sizeof(created_settings))
+				memcpy(&created_settings, data.data(), sizeof(created_settings));
+			settings_received = true;
+			packets_cond.notify_all();
+		}
+
+		if (header.flags & ENCODER_FLAG_QUERY_ENCODE) {
+			last_progress_ns = os_gettime_ns();
+			bytes_received += sizeof(header) + data.size();
+			if (header.size)
+				packets_received++;
+			if (header.flags & ENCODER_FLAG_ERROR)
+				request_failed = true;
+			if (!header.frames && pending_requests.size()) {
+				uint64_t rtt_ns = last_progress_ns - pending_requests.front();
+				encoder_histogram_add(&rtt_us, (uint32_t)(rtt_ns / 1000));
+				pending_requests.pop_front();
+			}
+		}
+
+		if ((header.flags & ENCODER_FLAG_QUERY_ENCODE) && (header.flags & ENCODER_FLAG_SHM) && header.size) {
+			ca_packet pkt;
+			pkt.pts = header.pts;
+			pkt.shm_data = shm_ring_arena_packet(&shm, &header, &pkt.shm_end);
+			pkt.shm_size = header.size;
+			if (pkt.shm_data)
+				packets.push_back(std::move(pkt));
+			else
+				blog(LOG_ERROR, "[%s] Packet of %u bytes is outside of the arena", name(), header.size);
+		}
+		else if ((header.flags & ENCODER_FLAG_QUERY_ENCODE) && header.size) {
+			std::vector<uint8_t> buffer;
+			if (free_buffers.size()) {
+				buffer.swap(free_buffers.back());
+				free_buffers.pop_back();
+			}
+			packets.push_back({header.pts, std::move(data)});
+			data.swap(buffer);
+		}
 
-	while (true) {
-		size_t start = buf.size();
-		buf.resize(start + 1024);
-		ssize_t n = read(ca->fd_err, buf.data() + start, buf.size() - start);
-		if (n >= 0)
-			buf.resize(start + n);
+		if (header.flags & ENCODER_FLAG_QUERY_EXTRA_DATA) {
+			received_extra_data.swap(data);
+			extra_data_received = true;
+			packets_cond.notify_all();
+		}
 
-		start = 0;
-		for (size_t i = 0; i < buf.size(); i++) {
-			if (buf[i] == '\n') {
-				buf[i] = 0;
-				blog(LOG_INFO, "[%s] pipe: %s", ca->name(), buf.data() + start);
-				start = i + 1;
+		if (header.flags & ENCODER_FLAG_SET_BITRATE) {
+			if (data.size() == sizeof(applied_bitrate)) {
+				memcpy(&applied_bitrate, data.data(), sizeof(applied_bitrate));
+				blog(LOG_INFO, "[%s] Bitrate changed to %u kbps", name(), applied_bitrate / 1000);
+			}
+			else {
+				blog(LOG_ERROR, "[%s] The co-process rejected the bitrate", name());
 			}
 		}
-		if (start)
-			buf.erase(buf.begin(), buf.begin() + start);
 
-		if (n <= 0) {
-			blog(LOG_INFO, "[%s] pipe closed", ca->name());
-			return;
+		if ((header.flags & ENCODER_FLAG_QUERY_STATS) && data.size() == sizeof(proc_stats)) {
+			memcpy(&proc_stats, data.data(), sizeof(proc_stats));
+			log_stats("periodic");
 		}
 	}
-}
+
+	/* Requires packets_mutex. Only a few buffers are kept so that a burst of packets does not stay allocated. */
+	void recycle_buffer(std::vector<uint8_t> &buffer)
+	{
+		if (free_buffers.size() < FREE_BUFFERS_MAX)
+			free_buffers.push_back(std::move(buffer));
+	}
+
+	/* Requires packets_mutex */
+	void log_stats(const char *when) const
+	{
+		double elapsed = (os_gettime_ns() - stats_start_ns) * 1e-9;
+		if (elapsed <= 0.0)
+			return;
+
+		blog(LOG_INFO,
+		     "[%s] %s stats: frames sent %llu, packets received %llu, "
+		     "round trip p50/p99/max %u/%u/%u us, pipe %.1f/%.1f KiB/s sent/received",
+		     name(), when, (unsigned long long)frames_sent, (unsigned long long)packets_received,
+		     encoder_histogram_percentile(&rtt_us, 50), encoder_histogram_percentile(&rtt_us, 99), rtt_us.max,
+		     bytes_sent / elapsed / 1024, bytes_received / elapsed / 1024);
+
+		if (proc_stats.struct_size != sizeof(proc_stats))
+			return;
+
+		blog(LOG_INFO,
+		     "[%s] %s stats of the co-process: frames %llu, packets %llu, "
+		     "encode p50/p99/max %u/%u/%u us, input buffer p50/p99/max %u/%u/%u bytes, "
+		     "peak working set %llu KiB",
+		     name(), when, (unsigned long long)proc_stats.frames, (unsigned long long)proc_stats.packets,
+		     encoder_histogram_percentile(&proc_stats.encode_us, 50),
+		     encoder_histogram_percentile(&proc_stats.encode_us, 99), proc_stats.encode_us.max,
+		     encoder_histogram_percentile(&proc_stats.input_buffer, 50),
+		     encoder_histogram_percentile(&proc_stats.input_buffer, 99), proc_stats.input_buffer.max,
+		     (unsigned long long)(proc_stats.peak_working_set / 1024));
+	}
+
+	/* Frames sent after the end of the last packet returned to OBS */
+	int64_t undelivered_frames() const
+	{
+		int64_t end = has_last_pts ? last_pts + (int64_t)out_frames_per_packet : 0;
+		return std::max<int64_t>(samples_sent - end, 0);
+	}
+
+	void on_close() override
+	{
+		std::unique_lock<std::mutex> lock(packets_mutex);
+		reader_eof = true;
+		packets_cond.notify_all();
+	}
+};
+
+} // namespace
 
 static const char *aac_get_name(void *)
 {
 	return obs_module_text("CoreAudioAAC");
 }
 
+static std::mutex instances_mutex;
+static std::set<ca_encoder *> instances;
+
 static void aac_destroy(void *data)
 {
 	ca_encoder *ca = static_cast<ca_encoder *>(data);
 
+	std::unique_lock<std::mutex> instances_lock(instances_mutex);
+	instances.erase(ca);
+	instances_lock.unlock();
+
+	std::unique_lock<std::mutex> lock(ca->packets_mutex);
+	ca->log_stats("final");
+	lock.unlock();
+
+	/* OBS has no call to drain an encoder before it stops, and a packet cannot be returned after this call.
+	 * ENCODER_FLAG_FLUSH is therefore not sent, and the tail can only be reported. */
+	if (ca->samples_sent)
+		blog(LOG_INFO, "[%s] %lld frames at the end were not delivered as packets", ca->name(),
+		     (long long)ca->undelivered_frames());
+
 	delete ca;
 }
 
-static inline bool start_proc(ca_encoder *ca)
+static inline bool start_proc(ca_encoder *ca, bool shared)
 {
-	BPtr<char> proc_path = obs_module_file("obs-coreaudio-encoder-proc.exe");
-	ca->pid = run_proc(proc_path, &ca->fd_req, &ca->fd_data, &ca->fd_err, NULL);
-	if (ca->pid < 0) {
-		blog(LOG_ERROR, "Failed to create Wine process for '%s'", proc_path.Get());
+	if (shared)
+		ca->proc = co_process_get_shared();
+	else
+		ca->proc = co_process_acquire(ca->name(), &ca->sched);
+
+	if (!ca->proc)
 		return false;
-	}
 
-	ca->stderr_thread = std::thread([ca] { stderr_thread_routine(ca); });
+	ca->stream_id = ca->proc->add_stream(ca);
+	if (!ca->stream_id) {
+		blog(LOG_ERROR, "[%s] The co-process has already exited", ca->name());
+		return false;
+	}
 
 	return true;
 }
 
+static bool write_header_data(ca_encoder *ca, struct encoder_data_header header, const uint8_t *data, const char *msg)
+{
+	if (!ca->proc)
+		return false;
+
+	header.stream_id = ca->stream_id;
+	return ca->proc->write(header, data, msg);
+}
+
 static inline bool transfer_encoder_settings(ca_encoder *ca, struct encoder_settings *settings)
 {
-	if (write(ca->fd_req, settings, sizeof(*settings)) != sizeof(*settings)) {
-		blog(LOG_ERROR, "[%s] Failed to write encoder-settings to the co-process", ca->name());
+	struct encoder_data_header header = {
+		.size = sizeof(*settings),
+		.frames = 0,
+		.pts = 0,
+		.flags = ENCODER_FLAG_CREATE,
+		.stream_id = 0,
+	};
+
+	if (!write_header_data(ca, header, (const uint8_t *)settings, "encoder-settings"))
+		return false;
+
+	std::unique_lock<std::mutex> lock(ca->packets_mutex);
+	if (!ca->packets_cond.wait_for(lock, std::chrono::milliseconds(SETTINGS_TIMEOUT_MS),
+				       [ca] { return ca->settings_received || ca->reader_eof; })) {
+		blog(LOG_ERROR, "[%s] Timed out waiting for the co-process to create the encoder", ca->name());
 		return false;
 	}
 
-	if (read(ca->fd_data, settings, sizeof(*settings)) != sizeof(*settings)) {
-		blog(LOG_ERROR, "[%s] Failed to read encoder-settings from the co-process", ca->name());
+	if (ca->created_settings.struct_size != sizeof(*settings)) {
+		blog(LOG_ERROR, "[%s] Failed to create the encoder in the co-process", ca->name());
 		return false;
 	}
 
+	*settings = ca->created_settings;
+
+	return true;
+}
+
+/* Starts or takes a co-process and creates the encoder in it. */
+static bool connect_proc(ca_encoder *ca)
+{
+	struct encoder_settings settings = ca->requested_settings;
+
+	if (ca->request_shm && shm_ring_create(&ca->shm, SHM_RING_SIZE, SHM_ARENA_SIZE)) {
+		settings.flags |= ENCODER_FLAG_SHM;
+		snprintf(settings.shm_path, sizeof(settings.shm_path), "%s", ca->shm.path);
+	}
+
+	if (!start_proc(ca, ca->shared_process))
+		return false;
+
+	if (!transfer_encoder_settings(ca, &settings))
+		return false;
+
+	if (ca->shm.header) {
+		/* The co-process has already mapped the file, or has given up. */
+		shm_ring_unlink(&ca->shm);
+
+		if (settings.flags & ENCODER_FLAG_SHM) {
+			ca->use_shm = true;
+		}
+		else {
+			blog(LOG_WARNING, "[%s] The co-process could not map the shared memory, using the pipe instead",
+			     ca->name());
+			shm_ring_destroy(&ca->shm);
+		}
+	}
+
+	if (ca->request_adts && !(settings.flags & ENCODER_FLAG_ADTS))
+		blog(LOG_WARNING, "[%s] The co-process cannot write ADTS, sending raw packets instead", ca->name());
+
+	/* The decoder has already been configured with the extra data if the co-process was restarted. */
+	const uint32_t extra_data_size = std::min<uint32_t>(settings.extra_data_size, ENCODER_EXTRA_DATA_MAX);
+	std::vector<uint8_t> extra_data(settings.extra_data, settings.extra_data + extra_data_size);
+	if (ca->extra_data.size() && extra_data != ca->extra_data) {
+		blog(LOG_ERROR, "[%s] The extra data from the restarted co-process does not match", ca->name());
+		return false;
+	}
+	if (!ca->extra_data.size())
+		ca->extra_data.swap(extra_data);
+
+	if (ca->out_frames_per_packet && ca->out_frames_per_packet != settings.out_frames_per_packet) {
+		blog(LOG_ERROR, "[%s] The frame size has changed from %zu to %u", ca->name(), ca->out_frames_per_packet,
+		     settings.out_frames_per_packet);
+		return false;
+	}
+	ca->out_frames_per_packet = settings.out_frames_per_packet;
+
+	if (ca->priming_frames != settings.priming_frames)
+		blog(LOG_INFO, "[%s] The encoder delay is %u frames", ca->name(), settings.priming_frames);
+	ca->priming_frames = settings.priming_frames;
+
 	return true;
 }
 
@@ -189,85 +483,308 @@ static void *aac_create(obs_data_t *settings, obs_encoder_t *encoder)
 		.samplerate_in = (uint32_t)ca->samples_per_second,
 		.samplerate_out = (uint32_t)obs_data_get_int(settings, "samplerate"),
 		.flags = 0,
+		.shm_path = {0},
+		.quality = (uint32_t)obs_data_get_int(settings, "quality"),
+		.rate_control = (uint32_t)obs_data_get_int(settings, "rate control"),
 		.out_frames_per_packet = 0,
+		.priming_frames = 0,
+		.extra_data_size = 0,
+		.extra_data = {0},
 	};
-	if (obs_data_get_bool(settings, "allow he-aac"))
+	ca->allow_he_aac = obs_data_get_bool(settings, "allow he-aac");
+	if (ca->allow_he_aac)
 		encoder_settings.flags |= ENCODER_FLAG_ALLOW_HE_AAC;
 
-	if (!start_proc(ca.get()))
+	ca->planar = obs_data_get_bool(settings, "planar");
+	if (ca->planar)
+		encoder_settings.flags |= ENCODER_FLAG_PLANAR;
+
+	ca->s16 = obs_data_get_bool(settings, "int16");
+	if (ca->s16)
+		encoder_settings.flags |= ENCODER_FLAG_S16;
+
+	ca->request_adts = obs_data_get_bool(settings, "adts");
+	if (ca->request_adts)
+		encoder_settings.flags |= ENCODER_FLAG_ADTS;
+
+	if (obs_data_get_bool(settings, "high priority"))
+		encoder_settings.flags |= ENCODER_FLAG_HIGH_PRIORITY;
+
+	const encoder_channel_map *channel_map = encoder_channel_map_find(encoder_settings.channels);
+	if (!channel_map) {
+		blog(LOG_ERROR, "[%s] Unsupported number of channels %u", ca->name(), encoder_settings.channels);
 		return NULL;
+	}
+
+	if (obs_data_get_bool(settings, "plugin remap") && !encoder_channel_map_is_identity(*channel_map)) {
+		ca->remap = channel_map;
+		encoder_settings.flags |= ENCODER_FLAG_REMAPPED;
+	}
 
-	if (!transfer_encoder_settings(ca.get(), &encoder_settings))
+	ca->frames_per_request = (uint32_t)std::clamp<int64_t>(obs_data_get_int(settings, "frames_per_request"), 1,
+								ENCODER_FRAMES_PER_REQUEST_MAX);
+	ca->in_frame_size = encoder_settings.channels * sizeof(float);
+
+	ca->requested_settings = encoder_settings;
+	ca->update_bitrate = bitrate;
+	ca->request_shm = obs_data_get_bool(settings, "shm");
+	ca->shared_process = obs_data_get_bool(settings, "shared process");
+
+	ca->sched.nice = (int)obs_data_get_int(settings, "nice");
+	ca->sched.fifo_priority = (int)obs_data_get_int(settings, "realtime priority");
+	const char *cpu_list = obs_data_get_string(settings, "cpu affinity");
+	if (!run_proc_parse_cpu_list(cpu_list, &ca->sched.cpu_mask)) {
+		blog(LOG_WARNING, "[%s] Ignoring invalid CPU affinity '%s'", ca->name(), cpu_list);
+		ca->sched.cpu_mask = 0;
+	}
+	if (ca->shared_process && !run_proc_sched_is_default(&ca->sched))
+		blog(LOG_WARNING, "[%s] Scheduling settings apply only to a dedicated process, ignoring them",
+		     ca->name());
+
+	ca->stats_start_ns = os_gettime_ns();
+	ca->next_stats_ns = ca->stats_start_ns + STATS_INTERVAL_NS;
+
+	if (!connect_proc(ca.get()))
 		return NULL;
 
-	ca->out_frames_per_packet = encoder_settings.out_frames_per_packet;
+	std::unique_lock<std::mutex> lock(instances_mutex);
+	instances.insert(ca.get());
 
 	return ca.release();
 }
 
-static bool write_header_data(ca_encoder *ca, const struct encoder_data_header &header, const uint8_t *data,
-			      const char *msg)
+static bool write_encode_request(ca_encoder *ca, const struct encoder_data_header &header, const uint8_t *data,
+				 const char *msg)
 {
-	if (write(ca->fd_req, &header, sizeof(header)) != sizeof(header)) {
-		blog(LOG_ERROR, "[%s] Failed to write header for %s", ca->name(), msg);
-		return false;
+	std::unique_lock<std::mutex> lock(ca->packets_mutex);
+	uint64_t now = os_gettime_ns();
+	if (!ca->pending_requests.size())
+		ca->last_progress_ns = now;
+	ca->pending_requests.push_back(now);
+	ca->frames_sent += header.frames;
+	ca->bytes_sent += sizeof(header) + ((header.flags & ENCODER_FLAG_SHM) ? 0 : header.size);
+	lock.unlock();
+
+	return write_header_data(ca, header, data, msg);
+}
+
+static bool flush_batch(ca_encoder *ca)
+{
+	if (!ca->batch.frames)
+		return true;
+
+	bool ret = write_encode_request(ca, ca->batch, ca->batch_buffer.data(), "frames");
+
+	ca->batch.size = 0;
+	ca->batch.frames = 0;
+	ca->batch_buffer.clear();
+
+	return ret;
+}
+
+static bool send_frame(ca_encoder *ca, const struct encoder_frame *frame)
+{
+	const uint8_t *const *planes = frame->data;
+	size_t n_planes = ca->planar ? ca->requested_settings.channels : 1;
+	uint32_t plane_size = frame->linesize[0];
+
+	/* Reordering the planes is free, interleaved frames are shuffled in a copy. */
+	const uint8_t *remapped[ENCODER_CHANNELS_MAX];
+	if (ca->remap && ca->planar) {
+		for (size_t i = 0; i < n_planes; i++)
+			remapped[i] = frame->data[ca->remap->map[i]];
+		planes = remapped;
+	}
+	else if (ca->remap) {
+		const size_t channels = ca->requested_settings.channels;
+		const size_t frames = plane_size / ca->in_frame_size;
+		ca->remap_buffer.resize(frames * channels);
+		pcm_remap_interleaved(ca->remap_buffer.data(), (const float *)frame->data[0], frames, channels,
+				      ca->remap->map);
+		remapped[0] = (const uint8_t *)ca->remap_buffer.data();
+		planes = remapped;
+	}
+
+	const uint8_t *converted = nullptr;
+	if (ca->s16) {
+		/* The converted planes are contiguous, so they are sent as one plane. */
+		const size_t n = plane_size / sizeof(float);
+		ca->convert_buffer.resize(n * n_planes);
+		for (size_t i = 0; i < n_planes; i++)
+			pcm_float_to_s16(ca->convert_buffer.data() + n * i, (const float *)planes[i], n);
+
+		converted = (const uint8_t *)ca->convert_buffer.data();
+		planes = &converted;
+		plane_size = (uint32_t)(n * n_planes * sizeof(int16_t));
+		n_planes = 1;
 	}
 
-	if (header.size && write(ca->fd_req, data, header.size) != header.size) {
-		blog(LOG_ERROR, "[%s] Failed to write data for %s", ca->name(), msg);
+	const uint32_t size = plane_size * (uint32_t)n_planes;
+
+	uint32_t flags = ENCODER_FLAG_QUERY_ENCODE;
+	if (ca->use_shm && shm_ring_write_planes(&ca->shm, planes, n_planes, plane_size))
+		flags |= ENCODER_FLAG_SHM;
+
+	/* Planes sent through the pipe are gathered in the batch buffer. */
+	if (!ca->batch.frames && ca->frames_per_request <= 1 && (n_planes == 1 || (flags & ENCODER_FLAG_SHM))) {
+		struct encoder_data_header header = {
+			.size = size,
+			.frames = 1,
+			.pts = frame->pts,
+			.flags = flags,
+			.stream_id = 0,
+		};
+		return write_encode_request(ca, header, planes[0], "frame");
+	}
+
+	/* A request carries its data either in the shared memory or in the pipe, not both. */
+	if (ca->batch.frames && ca->batch.flags != flags && !flush_batch(ca))
 		return false;
+
+	if (!ca->batch.frames) {
+		ca->batch.pts = frame->pts;
+		ca->batch.flags = flags;
+	}
+
+	if (!(flags & ENCODER_FLAG_SHM)) {
+		for (size_t i = 0; i < n_planes; i++)
+			ca->batch_buffer.insert(ca->batch_buffer.end(), planes[i], planes[i] + plane_size);
 	}
 
+	ca->batch.size += size;
+	ca->batch.frames++;
+
+	if (ca->batch.frames >= ca->frames_per_request)
+		return flush_batch(ca);
+
 	return true;
 }
 
-static bool aac_encode(void *data, struct encoder_frame *frame, struct encoder_packet *packet, bool *received_packet)
+static bool restart_proc(ca_encoder *ca);
+
+static void query_stats(ca_encoder *ca)
 {
-	ca_encoder *ca = static_cast<ca_encoder *>(data);
+	struct encoder_data_header header = {
+		.size = 0,
+		.frames = 0,
+		.pts = 0,
+		.flags = ENCODER_FLAG_QUERY_STATS,
+		.stream_id = 0,
+	};
+
+	write_header_data(ca, header, nullptr, "stats");
+}
+
+static bool send_bitrate(ca_encoder *ca, uint32_t bitrate)
+{
+	/* Frames waiting in the batch are encoded at the old bitrate. */
+	if (!flush_batch(ca))
+		return false;
 
 	struct encoder_data_header header = {
-		.size = frame->linesize[0],
-		.frames = 1,
-		.pts = frame->pts,
-		.flags = ENCODER_FLAG_QUERY_ENCODE,
+		.size = sizeof(bitrate),
+		.frames = 0,
+		.pts = 0,
+		.flags = ENCODER_FLAG_SET_BITRATE,
+		.stream_id = 0,
 	};
 
-	if (!write_header_data(ca, header, frame->data[0], "frame"))
+	return write_header_data(ca, header, (const uint8_t *)&bitrate, "bitrate");
+}
+
+static bool aac_encode(void *data, struct encoder_frame *frame, struct encoder_packet *packet, bool *received_packet)
+{
+	ca_encoder *ca = static_cast<ca_encoder *>(data);
+
+	*received_packet = false;
+
+	/* OBS has copied the packet returned by the previous call. */
+	if (ca->holds_shm_packet) {
+		shm_ring_arena_release(&ca->shm, ca->held_shm_end);
+		ca->holds_shm_packet = false;
+	}
+
+	uint32_t bitrate = ca->pending_bitrate.exchange(0);
+	if (bitrate && !send_bitrate(ca, bitrate) && !(restart_proc(ca) && send_bitrate(ca, bitrate)))
 		return false;
 
-	if (read(ca->fd_data, &header, sizeof(header)) != sizeof(header)) {
-		blog(LOG_INFO, "[%s] Failed to read encoded packet header", ca->name());
+	if (!send_frame(ca, frame) && !(restart_proc(ca) && send_frame(ca, frame)))
 		return false;
+
+	ca->samples_sent += frame->linesize[0] / (ca->planar ? sizeof(float) : ca->in_frame_size);
+
+	uint64_t now = os_gettime_ns();
+	if (now >= ca->next_stats_ns) {
+		/* The reply is logged by the reader thread. */
+		ca->next_stats_ns = now + STATS_INTERVAL_NS;
+		query_stats(ca);
 	}
 
-	if (!header.size) {
-		*received_packet = false;
-		return true;
+	/* Packets are collected by reader_thread so that this call does not wait for the co-process. */
+	std::unique_lock<std::mutex> lock(ca->packets_mutex);
+
+	/* After a restart, the priming packets of the new encoder overlap with the last packets. */
+	while (ca->packets.size() && ca->has_last_pts && ca->packets.front().pts + ca->pts_offset <= ca->last_pts) {
+		if (ca->packets.front().shm_data)
+			shm_ring_arena_release(&ca->shm, ca->packets.front().shm_end);
+		else
+			ca->recycle_buffer(ca->packets.front().data);
+		ca->packets.pop_front();
 	}
 
-	ca->encode_buffer.resize(header.size);
-	if (read(ca->fd_data, ca->encode_buffer.data(), header.size) != header.size) {
-		blog(LOG_INFO, "[%s] Failed to read encoded packet data", ca->name());
-		return false;
+	/* A rejected request leaves a gap, so the encoder is started again as if the co-process had failed. */
+	const char *failure = nullptr;
+	if (ca->request_failed)
+		failure = "has dropped the audio of a request";
+	else if (!ca->packets.size() && ca->reader_eof)
+		failure = "has closed the pipe";
+	else if (!ca->packets.size() && ca->pending_requests.size() &&
+		 ca->last_progress_ns + ENCODE_STALL_TIMEOUT_NS < now)
+		failure = "has stopped replying";
+
+	if (failure) {
+		blog(LOG_ERROR, "[%s] The co-process %s", ca->name(), failure);
+		lock.unlock();
+		return restart_proc(ca);
+	}
+
+	if (!ca->packets.size())
+		return true;
+
+	ca_packet &pkt = ca->packets.front();
+	if (pkt.shm_data) {
+		packet->data = (uint8_t *)pkt.shm_data;
+		packet->size = pkt.shm_size;
+		ca->holds_shm_packet = true;
+		ca->held_shm_end = pkt.shm_end;
+	}
+	else {
+		ca->encode_buffer.swap(pkt.data);
+		ca->recycle_buffer(pkt.data);
+		packet->data = ca->encode_buffer.data();
+		packet->size = ca->encode_buffer.size();
 	}
+	packet->pts = pkt.pts + ca->pts_offset;
+	packet->dts = packet->pts;
+	ca->packets.pop_front();
+
+	ca->last_pts = packet->pts;
+	ca->has_last_pts = true;
 
 	*received_packet = true;
 
-	packet->pts = header.pts;
-	packet->dts = header.pts;
 	packet->timebase_num = 1;
 	packet->timebase_den = (uint32_t)ca->samples_per_second;
 	packet->type = OBS_ENCODER_AUDIO;
 	packet->keyframe = true;
-	packet->size = header.size;
-	packet->data = ca->encode_buffer.data();
 
 	return true;
 }
 
-static void aac_audio_info(void *, struct audio_convert_info *info)
+static void aac_audio_info(void *data, struct audio_convert_info *info)
 {
-	info->format = AUDIO_FORMAT_FLOAT;
+	ca_encoder *ca = static_cast<ca_encoder *>(data);
+	info->format = ca && ca->planar ? AUDIO_FORMAT_FLOAT_PLANAR : AUDIO_FORMAT_FLOAT;
 }
 
 static size_t aac_frame_size(void *data)
@@ -276,31 +793,91 @@ static size_t aac_frame_size(void *data)
 	return ca->out_frames_per_packet;
 }
 
-static void query_extra_data(ca_encoder *ca)
+static bool query_extra_data(ca_encoder *ca, std::vector<uint8_t> &extra_data)
 {
 	struct encoder_data_header header = {
 		.size = 0,
 		.frames = 0,
 		.pts = 0,
 		.flags = ENCODER_FLAG_QUERY_EXTRA_DATA,
+		.stream_id = 0,
 	};
 
+	std::unique_lock<std::mutex> lock(ca->packets_mutex);
+	ca->extra_data_received = false;
+	lock.unlock();
+
 	if (!write_header_data(ca, header, nullptr, "extra-data"))
-		return;
+		return false;
 
-	if (read(ca->fd_data, &header, sizeof(header)) != sizeof(header)) {
-		blog(LOG_INFO, "[%s] Failed to read extra-data header", ca->name());
-		return;
+	lock.lock();
+	ca->packets_cond.wait_for(lock, std::chrono::milliseconds(EXTRA_DATA_TIMEOUT_MS),
+				  [ca] { return ca->extra_data_received || ca->reader_eof; });
+
+	if (!ca->extra_data_received) {
+		blog(LOG_INFO, "[%s] Failed to read extra-data", ca->name());
+		return false;
 	}
 
-	if (!header.size)
-		return;
+	extra_data.swap(ca->received_extra_data);
+	return true;
+}
 
-	ca->extra_data.resize(header.size);
-	if (read(ca->fd_data, ca->extra_data.data(), header.size) != header.size) {
-		blog(LOG_INFO, "[%s] Failed to read extra-data", ca->name());
-		return;
+/* Replaces a co-process that has exited or stalled, and replays the encoder settings. */
+static bool restart_proc(ca_encoder *ca)
+{
+	uint64_t now = os_gettime_ns();
+	if (ca->last_restart_ns && now - ca->last_restart_ns < RESTART_INTERVAL_NS) {
+		blog(LOG_ERROR, "[%s] The co-process failed again soon after the restart, giving up", ca->name());
+		return false;
 	}
+	ca->last_restart_ns = now;
+
+	blog(LOG_WARNING, "[%s] Restarting the co-process after %lld samples", ca->name(),
+	     (long long)ca->samples_sent);
+
+	if (ca->proc) {
+		ca->proc->terminate();
+
+		/* Wait for the reader thread so that a shared process is no longer handed out. */
+		std::unique_lock<std::mutex> lock(ca->packets_mutex);
+		ca->packets_cond.wait_for(lock, std::chrono::milliseconds(READER_EXIT_TIMEOUT_MS),
+					  [ca] { return ca->reader_eof; });
+		lock.unlock();
+
+		ca->proc->remove_stream(ca->stream_id);
+		ca->stream_id = 0;
+		ca->proc.reset();
+	}
+
+	std::unique_lock<std::mutex> lock(ca->packets_mutex);
+	for (ca_packet &pkt : ca->packets) {
+		if (!pkt.shm_data)
+			ca->recycle_buffer(pkt.data);
+	}
+	ca->packets.clear();
+	ca->pending_requests.clear();
+	ca->settings_received = false;
+	ca->extra_data_received = false;
+	ca->reader_eof = false;
+	ca->request_failed = false;
+	ca->created_settings = {};
+	if (ca->applied_bitrate)
+		ca->requested_settings.bitrate = ca->applied_bitrate;
+	lock.unlock();
+
+	ca->batch.size = 0;
+	ca->batch.frames = 0;
+	ca->batch_buffer.clear();
+
+	if (ca->shm.header)
+		shm_ring_destroy(&ca->shm);
+	ca->use_shm = false;
+	ca->holds_shm_packet = false;
+
+	ca->pts_offset = ca->samples_sent;
+
+	return connect_proc(ca);
 }
 
 static bool aac_extra_data(void *data, uint8_t **extra_data, size_t *size)
@@ -308,7 +885,7 @@ static bool aac_extra_data(void *data, uint8_t **extra_data, size_t *size)
 	ca_encoder *ca = static_cast<ca_encoder *>(data);
 
 	if (!ca->extra_data.size())
-		query_extra_data(ca);
+		query_extra_data(ca, ca->extra_data);
 
 	if (!ca->extra_data.size())
 		return false;
@@ -318,53 +895,61 @@ static bool aac_extra_data(void *data, uint8_t **extra_data, size_t *size)
 	return true;
 }
 
-static const std::vector<uint32_t> &get_bitrates()
+static std::vector<uint32_t> get_bitrates(bool allow_he_aac, uint32_t samplerate, bool wait = true);
+
+/* Only the bitrate is changed on the running encoder. The other settings take effect at the next start. */
+static bool aac_update(void *data, obs_data_t *settings)
 {
-	static const std::vector<uint32_t> bitrates;
-	static bool once = false;
+	ca_encoder *ca = static_cast<ca_encoder *>(data);
 
-	if (once)
-		return bitrates;
+	uint32_t bitrate = (uint32_t)obs_data_get_int(settings, "bitrate") * 1000;
+	if (!bitrate || bitrate == ca->update_bitrate)
+		return true;
 
-	// TODO: Call the process and get the bitrates.
+	uint32_t samplerate = ca->requested_settings.samplerate_out;
+	if (!samplerate)
+		samplerate = (uint32_t)ca->samples_per_second;
 
-	return bitrates;
+	/* The co-process checks the bitrate again against the converter. */
+	auto bitrates = get_bitrates(ca->allow_he_aac, samplerate, false);
+	if (bitrates.size() && find(begin(bitrates), end(bitrates), bitrate) == end(bitrates)) {
+		blog(LOG_WARNING, "[%s] Bitrate %u kbps is not supported, keeping %u kbps", ca->name(), bitrate / 1000,
+		     ca->update_bitrate / 1000);
+		return false;
+	}
+
+	blog(LOG_INFO, "[%s] Changing the bitrate from %u to %u kbps", ca->name(), ca->update_bitrate / 1000,
+	     bitrate / 1000);
+	ca->update_bitrate = bitrate;
+	ca->pending_bitrate = bitrate;
+	return true;
 }
 
 static bool find_best_match(uint32_t bitrate, uint32_t &best_match)
 {
-	uint32_t actual_bitrate = bitrate * 1000;
+	const int64_t actual_bitrate = (int64_t)bitrate * 1000;
 	bool found_match = false;
+	int64_t best_diff = 0;
 
-	auto handle_bitrate = [&](uint32_t candidate) {
-		if (abs(static_cast<intmax_t>(actual_bitrate - candidate)) <
-		    abs(static_cast<intmax_t>(actual_bitrate - best_match))) {
+	// Don't wait for the background probe; defaults are requested while OBS is starting.
+	// The capability cache is read each time so that the list is used once the probe has finished.
+	for (uint32_t candidate : get_bitrates(true, 44100, false)) {
+		int64_t diff = std::abs(actual_bitrate - (int64_t)candidate);
+		if (!found_match || diff < best_diff) {
 			found_match = true;
-			best_match = candidate;
+			best_diff = diff;
+			best_match = candidate / 1000;
 		}
-	};
-
-	for (uint32_t candidate : get_bitrates())
-		handle_bitrate(candidate);
-
-	best_match /= 1000;
+	}
 
 	return found_match;
 }
 
+/* Returns 'bitrate' itself while no bitrate is known. */
 static uint32_t find_matching_bitrate(uint32_t bitrate)
 {
-	static uint32_t match = bitrate;
-
-	static std::once_flag once;
-
-	call_once(once, [&]() {
-		if (!find_best_match(bitrate, match)) {
-			match = bitrate;
-			return;
-		}
-	});
-
+	uint32_t match = bitrate;
+	find_best_match(bitrate, match);
 	return match;
 }
 
@@ -373,30 +958,41 @@ static void aac_defaults(obs_data_t *settings)
 	obs_data_set_default_int(settings, "samplerate", 0); //match input
 	obs_data_set_default_int(settings, "bitrate", find_matching_bitrate(128));
 	obs_data_set_default_bool(settings, "allow he-aac", true);
+	obs_data_set_default_int(settings, "rate control", ENCODER_RATE_CONTROL_CBR);
+	obs_data_set_default_int(settings, "quality", ENCODER_QUALITY_MAX);
+	obs_data_set_default_bool(settings, "shm", true);
+	obs_data_set_default_bool(settings, "adts", false);
+	obs_data_set_default_bool(settings, "planar", true);
+	obs_data_set_default_bool(settings, "int16", false);
+	obs_data_set_default_bool(settings, "plugin remap", false);
+	obs_data_set_default_int(settings, "frames_per_request", 1);
+	obs_data_set_default_bool(settings, "shared process", false);
+	obs_data_set_default_int(settings, "nice", 0);
+	obs_data_set_default_int(settings, "realtime priority", 0);
+	obs_data_set_default_string(settings, "cpu affinity", "");
+	obs_data_set_default_bool(settings, "high priority", false);
 }
 
-static std::vector<uint32_t> get_samplerates(ca_encoder *ca)
+static std::vector<uint32_t> get_samplerates(bool allow_he_aac)
 {
-	std::vector<uint32_t> samplerates;
+	const ca_capabilities *caps = ca_capabilities_get(allow_he_aac);
+	if (!caps)
+		return std::vector<uint32_t>();
 
-	(void)ca; // TODO: Implement
-
-	return samplerates;
+	return caps->samplerates;
 }
 
-static void add_samplerates(obs_property_t *prop, ca_encoder *ca)
+static void add_samplerates(obs_property_t *prop, bool allow_he_aac)
 {
 	obs_property_list_add_int(prop, obs_module_text("UseInputSampleRate"), 0);
 
-	auto samplerates = get_samplerates(ca);
+	auto samplerates = get_samplerates(allow_he_aac);
 
 	if (!samplerates.size()) {
-		blog(LOG_ERROR, "[%s] Couldn't find available sample rates", ca->name());
+		blog(LOG_ERROR, "Couldn't find available sample rates");
 		return;
 	}
 
-	sort(begin(samplerates), end(samplerates));
-
 	for (uint32_t samplerate : samplerates) {
 		char buffer[32] = {0};
 		snprintf(buffer, sizeof(buffer) - 1, "%u", samplerate);
@@ -404,21 +1000,27 @@ static void add_samplerates(obs_property_t *prop, ca_encoder *ca)
 	}
 }
 
-static std::vector<uint32_t> get_bitrates(ca_encoder *ca, float samplerate)
+static std::vector<uint32_t> get_bitrates(bool allow_he_aac, uint32_t samplerate, bool wait)
 {
-	std::vector<uint32_t> bitrates;
+	const ca_capabilities *caps = ca_capabilities_get(allow_he_aac, wait);
+	if (!caps || caps->bitrates.empty())
+		return std::vector<uint32_t>();
 
-	(void)ca;
-	(void)samplerate; // TODO: Implement
+	// Fall back to the closest listed sample rate.
+	auto it = caps->bitrates.lower_bound(samplerate);
+	if (it == caps->bitrates.end() || (it != caps->bitrates.begin() && it->first != samplerate &&
+					   samplerate - std::prev(it)->first < it->first - samplerate))
+		--it;
 
-	return bitrates;
+	return it->second;
 }
 
-static void add_bitrates(obs_property_t *prop, ca_encoder *ca, double samplerate = 44100., uint32_t *selected = nullptr)
+static void add_bitrates(obs_property_t *prop, bool allow_he_aac, uint32_t samplerate = 44100,
+			 uint32_t *selected = nullptr)
 {
 	obs_property_list_clear(prop);
 
-	auto bitrates = get_bitrates(ca, samplerate);
+	auto bitrates = get_bitrates(allow_he_aac, samplerate);
 
 	if (!bitrates.size()) {
 		blog(LOG_ERROR, "Couldn't find available bitrates");
@@ -457,7 +1059,7 @@ static bool samplerate_updated(obs_properties_t *props, obs_property_t *prop, ob
 	if (prop) {
 		auto bitrate = static_cast<uint32_t>(obs_data_get_int(settings, "bitrate"));
 
-		add_bitrates(prop, nullptr, samplerate, &bitrate);
+		add_bitrates(prop, obs_data_get_bool(settings, "allow he-aac"), samplerate, &bitrate);
 
 		return true;
 	}
@@ -478,17 +1080,142 @@ extern "C" obs_properties_t *aac_properties(void *data)
 	obs_property_t *bit_rates = obs_properties_add_list(props, "bitrate", obs_module_text("Bitrate"),
 							    OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
 
-	obs_properties_add_bool(props, "allow he-aac", obs_module_text("AllowHEAAC"));
+	obs_property_t *prop = obs_properties_add_bool(props, "allow he-aac", obs_module_text("AllowHEAAC"));
+	obs_property_set_modified_callback(prop, samplerate_updated);
 
-	if (data) {
-		ca_encoder *ca = static_cast<ca_encoder *>(data);
-		add_samplerates(sample_rates, ca);
-		add_bitrates(bit_rates, ca);
-	}
+	prop = obs_properties_add_list(props, "rate control", obs_module_text("RateControl"), OBS_COMBO_TYPE_LIST,
+				       OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, obs_module_text("RateControl.CBR"), ENCODER_RATE_CONTROL_CBR);
+	obs_property_list_add_int(prop, obs_module_text("RateControl.ABR"), ENCODER_RATE_CONTROL_ABR);
+	obs_property_list_add_int(prop, obs_module_text("RateControl.CVBR"), ENCODER_RATE_CONTROL_VBR_CONSTRAINED);
+
+	prop = obs_properties_add_list(props, "quality", obs_module_text("Quality"), OBS_COMBO_TYPE_LIST,
+				       OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, obs_module_text("Quality.Max"), ENCODER_QUALITY_MAX);
+	obs_property_list_add_int(prop, obs_module_text("Quality.High"), 0x60);
+	obs_property_list_add_int(prop, obs_module_text("Quality.Medium"), 0x40);
+	obs_property_list_add_int(prop, obs_module_text("Quality.Low"), 0x20);
+	obs_property_list_add_int(prop, obs_module_text("Quality.Min"), 0);
+	obs_property_set_long_description(prop, obs_module_text("Quality.Description"));
+
+	obs_properties_add_bool(props, "shm", obs_module_text("SharedMemory"));
+
+	obs_properties_add_bool(props, "planar", obs_module_text("PlanarInput"));
+
+	prop = obs_properties_add_bool(props, "adts", obs_module_text("ADTS"));
+	obs_property_set_long_description(prop, obs_module_text("ADTS.Description"));
+
+	prop = obs_properties_add_bool(props, "int16", obs_module_text("Int16Input"));
+	obs_property_set_long_description(prop, obs_module_text("Int16Input.Description"));
+
+	prop = obs_properties_add_bool(props, "plugin remap", obs_module_text("PluginRemap"));
+	obs_property_set_long_description(prop, obs_module_text("PluginRemap.Description"));
+
+	prop = obs_properties_add_int(props, "frames_per_request", obs_module_text("FramesPerRequest"),
+						      1, ENCODER_FRAMES_PER_REQUEST_MAX, 1);
+	obs_property_set_long_description(prop, obs_module_text("FramesPerRequest.Description"));
+
+	prop = obs_properties_add_bool(props, "shared process", obs_module_text("SharedProcess"));
+	obs_property_set_long_description(prop, obs_module_text("SharedProcess.Description"));
+
+	prop = obs_properties_add_int(props, "nice", obs_module_text("Nice"), -20, 19, 1);
+	obs_property_set_long_description(prop, obs_module_text("Nice.Description"));
+
+	prop = obs_properties_add_int(props, "realtime priority", obs_module_text("RealtimePriority"), 0, 99, 1);
+	obs_property_set_long_description(prop, obs_module_text("RealtimePriority.Description"));
+
+	prop = obs_properties_add_text(props, "cpu affinity", obs_module_text("CPUAffinity"), OBS_TEXT_DEFAULT);
+	obs_property_set_long_description(prop, obs_module_text("CPUAffinity.Description"));
+
+	prop = obs_properties_add_bool(props, "high priority", obs_module_text("HighPriority"));
+	obs_property_set_long_description(prop, obs_module_text("HighPriority.Description"));
+
+	ca_encoder *ca = static_cast<ca_encoder *>(data);
+	bool allow_he_aac = ca ? ca->allow_he_aac : true;
+	add_samplerates(sample_rates, allow_he_aac);
+	add_bitrates(bit_rates, allow_he_aac);
 
 	return props;
 }
 
+static void append_json(std::string &json, const char *format, ...)
+{
+	char buf[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	json += buf;
+}
+
+static void append_histogram(std::string &json, const char *name, const struct encoder_histogram &h)
+{
+	append_json(json, ", \"%s\": {\"count\": %llu, \"p50\": %u, \"p99\": %u, \"max\": %u}", name,
+		    (unsigned long long)encoder_histogram_total(&h), encoder_histogram_percentile(&h, 50),
+		    encoder_histogram_percentile(&h, 99), h.max);
+}
+
+/* Requires packets_mutex */
+static void append_stats(std::string &json, const ca_encoder *ca)
+{
+	json += "{\"name\": \"";
+	for (const char *p = ca->name(); *p; p++) {
+		if (*p == '"' || *p == '\\')
+			json += '\\';
+		json += *p;
+	}
+	json += '"';
+
+	append_json(json, ", \"seconds\": %.3f", (os_gettime_ns() - ca->stats_start_ns) * 1e-9);
+	append_json(json, ", \"frames_sent\": %llu", (unsigned long long)ca->frames_sent);
+	append_json(json, ", \"packets_received\": %llu", (unsigned long long)ca->packets_received);
+	append_json(json, ", \"bytes_sent\": %llu", (unsigned long long)ca->bytes_sent);
+	append_json(json, ", \"bytes_received\": %llu", (unsigned long long)ca->bytes_received);
+	append_histogram(json, "round_trip_us", ca->rtt_us);
+	append_json(json, ", \"priming_frames\": %u", ca->priming_frames);
+	append_json(json, ", \"undelivered_frames\": %lld", (long long)ca->undelivered_frames());
+
+	const struct encoder_stats &ps = ca->proc_stats;
+	if (ps.struct_size == sizeof(ps)) {
+		json += ", \"co_process\": {";
+		append_json(json, "\"frames\": %llu, \"packets\": %llu, \"input_buffer_max\": %u",
+			    (unsigned long long)ps.frames, (unsigned long long)ps.packets, ps.input_buffer_max);
+		append_histogram(json, "encode_us", ps.encode_us);
+		append_histogram(json, "input_buffer", ps.input_buffer);
+		json += '}';
+	}
+
+	json += '}';
+}
+
+/* Returns the statistics of the encoders as JSON. If 'name' is not empty, only the encoder with the name is listed.
+ * The co-process part is as of the last periodic query. */
+static void get_stats_proc(void *, calldata_t *cd)
+{
+	const char *name = nullptr;
+	calldata_get_string(cd, "name", &name);
+
+	std::string json = "{\"encoders\": [";
+	bool first = true;
+
+	std::unique_lock<std::mutex> instances_lock(instances_mutex);
+	for (ca_encoder *ca : instances) {
+		if (name && *name && strcmp(name, ca->name()) != 0)
+			continue;
+
+		if (!first)
+			json += ", ";
+		first = false;
+
+		std::unique_lock<std::mutex> lock(ca->packets_mutex);
+		append_stats(json, ca);
+	}
+	instances_lock.unlock();
+
+	json += "]}";
+	calldata_set_string(cd, "json", json.c_str());
+}
+
 extern "C" void register_aac_info()
 {
 	struct obs_encoder_info aac_info = {};
@@ -499,6 +1226,7 @@ extern "C" void register_aac_info()
 	aac_info.destroy = aac_destroy;
 	aac_info.create = aac_create;
 	aac_info.encode = aac_encode;
+	aac_info.update = aac_update;
 	aac_info.get_frame_size = aac_frame_size;
 	aac_info.get_audio_info = aac_audio_info;
 	aac_info.get_extra_data = aac_extra_data;
@@ -506,4 +1234,7 @@ extern "C" void register_aac_info()
 	aac_info.get_properties = aac_properties;
 
 	obs_register_encoder(&aac_info);
+
+	proc_handler_add(obs_get_proc_handler(), "void coreaudio_aac_get_stats(in string name, out string json)",
+			 get_stats_proc, nullptr);
 };
@@ -0,0 +1,307 @@
+/*
+ * OBS CoreAudio Encoder Plugin for Linux
+ * Copyright (C) 2024 Norihiro Kamae <norihiro@nagater.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <obs-module.h>
+#include <util/platform.h>
+#include <util/util.hpp>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "plugin-macros.generated.h"
+#include "encoder-proc/encoder-proc-version.h"
+#include "capabilities.hpp"
+#include "run-proc.h"
+#include "io-util.h"
+
+#define CACHE_FILE "capabilities.json"
+
+/* Listing every sample rate and bitrate takes a few seconds. */
+#define QUERY_TIMEOUT_MS 60000
+
+static std::mutex caps_mutex;
+static std::condition_variable caps_cond;
+static bool caps_loaded = false;
+static bool caps_probing = false;
+static std::thread probe_thread;
+static bool caps_available[2] = {false, false};
+static ca_capabilities caps[2];
+
+/* Translates a path such as 'C:\windows\system32\CoreAudioToolbox.dll' to the Unix path through the dosdevices
+ * directory of the Wine prefix. */
+static std::string wine_path_to_unix(const char *path)
+{
+	if (!path || !isalpha((unsigned char)path[0]) || path[1] != ':')
+		return std::string();
+
+	std::string ret;
+	const char *prefix = getenv("WINEPREFIX");
+	if (prefix && *prefix) {
+		ret = prefix;
+	}
+	else {
+		const char *home = getenv("HOME");
+		if (!home)
+			return std::string();
+		ret = home;
+		ret += "/.wine";
+	}
+
+	ret += "/dosdevices/";
+	ret += (char)tolower((unsigned char)path[0]);
+	ret += ':';
+	for (const char *p = path + 2; *p; p++)
+		ret += *p == '\\' ? '/' : *p;
+
+	return ret;
+}
+
+static bool stat_file(const char *path, int64_t &size, int64_t &mtime)
+{
+	struct stat st;
+	if (!path || stat(path, &st) != 0)
+		return false;
+
+	size = (int64_t)st.st_size;
+	mtime = (int64_t)st.st_mtime;
+	return true;
+}
+
+static bool cache_valid(obs_data_t *data)
+{
+	if (obs_data_get_int(data, "proc_version") != ENCODER_PROC_VERSION)
+		return false;
+
+	BPtr<char> proc_path = obs_module_file("obs-coreaudio-encoder-proc.exe");
+	int64_t size, mtime;
+	if (!stat_file(proc_path, size, mtime) || obs_data_get_int(data, "proc_mtime") != mtime)
+		return false;
+
+	obs_data_t *dll = obs_data_get_obj(data, "dll");
+	std::string dll_path = wine_path_to_unix(obs_data_get_string(dll, "path"));
+	bool valid = stat_file(dll_path.c_str(), size, mtime) && obs_data_get_int(dll, "size") == size &&
+		     obs_data_get_int(dll, "mtime") == mtime;
+	obs_data_release(dll);
+
+	return valid;
+}
+
+static obs_data_t *query_proc()
+{
+	BPtr<char> proc_path = obs_module_file("obs-coreaudio-encoder-proc.exe");
+	int fd_out = -1;
+	pid_t pid = run_proc(proc_path, NULL, &fd_out, NULL, "-l");
+	if (pid <= 0) {
+		blog(LOG_ERROR, "Failed to create Wine process for '%s'", proc_path.Get());
+		return nullptr;
+	}
+
+	std::string json;
+	char buf[4096];
+	ssize_t n;
+	uint64_t deadline = os_gettime_ns() + QUERY_TIMEOUT_MS * 1000000ULL;
+	while (true) {
+		uint64_t now = os_gettime_ns();
+		int timeout_ms = now < deadline ? (int)((deadline - now) / 1000000) : 0;
+		if ((n = io_read_some(fd_out, buf, sizeof(buf), timeout_ms)) <= 0)
+			break;
+		json.append(buf, n);
+	}
+	close(fd_out);
+
+	if (n < 0) {
+		blog(LOG_ERROR, "Failed to read the capabilities: %s", strerror(errno));
+		kill(pid, SIGKILL);
+	}
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		blog(LOG_ERROR, "Failed to list the capabilities, status=%d", status);
+		return nullptr;
+	}
+
+	obs_data_t *data = obs_data_create_from_json(json.c_str());
+	if (!data) {
+		blog(LOG_ERROR, "Failed to parse the capabilities");
+		return nullptr;
+	}
+
+	int64_t size, mtime;
+	if (stat_file(proc_path, size, mtime))
+		obs_data_set_int(data, "proc_mtime", mtime);
+	obs_data_set_int(data, "proc_version", ENCODER_PROC_VERSION);
+
+	return data;
+}
+
+static void save_cache(obs_data_t *data)
+{
+	BPtr<char> dir = obs_module_config_path("");
+	if (os_mkdirs(dir) == MKDIR_ERROR) {
+		blog(LOG_WARNING, "Failed to create directory '%s'", dir.Get());
+		return;
+	}
+
+	BPtr<char> path = obs_module_config_path(CACHE_FILE);
+	if (!obs_data_save_json_safe(data, path, "tmp", "bak"))
+		blog(LOG_WARNING, "Failed to save '%s'", path.Get());
+}
+
+static std::vector<uint32_t> parse_list(obs_data_t *data, const char *name, const char *item_name)
+{
+	std::vector<uint32_t> ret;
+
+	obs_data_array_t *array = obs_data_get_array(data, name);
+	size_t count = obs_data_array_count(array);
+	for (size_t i = 0; i < count; i++) {
+		obs_data_t *item = obs_data_array_item(array, i);
+		ret.push_back((uint32_t)obs_data_get_int(item, item_name));
+		obs_data_release(item);
+	}
+	obs_data_array_release(array);
+
+	return ret;
+}
+
+static void parse_caps(obs_data_t *data)
+{
+	obs_data_array_t *formats = obs_data_get_array(data, "formats");
+	size_t count = obs_data_array_count(formats);
+	for (size_t i = 0; i < count; i++) {
+		obs_data_t *format = obs_data_array_item(formats, i);
+		size_t ix = obs_data_get_bool(format, "he-aac") ? 1 : 0;
+		ca_capabilities &c = caps[ix];
+
+		obs_data_array_t *samplerates = obs_data_get_array(format, "samplerates");
+		size_t n_samplerates = obs_data_array_count(samplerates);
+		for (size_t j = 0; j < n_samplerates; j++) {
+			obs_data_t *item = obs_data_array_item(samplerates, j);
+			auto samplerate = (uint32_t)obs_data_get_int(item, "samplerate");
+			c.samplerates.push_back(samplerate);
+			c.bitrates[samplerate] = parse_list(item, "bitrates", "bitrate");
+			obs_data_release(item);
+		}
+		obs_data_array_release(samplerates);
+
+		caps_available[ix] = c.samplerates.size() > 0;
+		obs_data_release(format);
+	}
+	obs_data_array_release(formats);
+}
+
+static bool load_cache()
+{
+	BPtr<char> path = obs_module_config_path(CACHE_FILE);
+	obs_data_t *data = os_file_exists(path) ? obs_data_create_from_json_file(path) : nullptr;
+	if (!data)
+		return false;
+
+	bool valid = cache_valid(data);
+	if (valid)
+		parse_caps(data);
+	else
+		blog(LOG_INFO, "Cached capabilities are outdated");
+
+	obs_data_release(data);
+	return valid;
+}
+
+static obs_data_t *probe()
+{
+	uint64_t start = os_gettime_ns();
+	obs_data_t *data = query_proc();
+	if (!data)
+		return nullptr;
+
+	blog(LOG_INFO, "Listed the capabilities in %.3f s", (os_gettime_ns() - start) * 1e-9);
+	save_cache(data);
+	return data;
+}
+
+static void probe_thread_routine()
+{
+	obs_data_t *data = probe();
+
+	std::unique_lock<std::mutex> lock(caps_mutex);
+	if (data) {
+		parse_caps(data);
+		obs_data_release(data);
+	}
+	else {
+		blog(LOG_ERROR, "CoreAudio AAC encoder not installed on the system or couldn't be loaded");
+	}
+	caps_loaded = true;
+	caps_probing = false;
+	caps_cond.notify_all();
+}
+
+extern "C" bool ca_capabilities_start(void)
+{
+	std::unique_lock<std::mutex> lock(caps_mutex);
+
+	if (load_cache()) {
+		caps_loaded = true;
+		return caps_available[0] || caps_available[1];
+	}
+
+	// Assume the encoder is available and confirm it without blocking the startup.
+	caps_probing = true;
+	probe_thread = std::thread(probe_thread_routine);
+	return true;
+}
+
+extern "C" void ca_capabilities_stop(void)
+{
+	if (probe_thread.joinable())
+		probe_thread.join();
+}
+
+const ca_capabilities *ca_capabilities_get(bool allow_he_aac, bool wait)
+{
+	std::unique_lock<std::mutex> lock(caps_mutex);
+
+	if (caps_probing) {
+		if (!wait)
+			return nullptr;
+		caps_cond.wait(lock, [] { return !caps_probing; });
+	}
+
+	if (!caps_loaded) {
+		if (!load_cache()) {
+			obs_data_t *data = probe();
+			if (data) {
+				parse_caps(data);
+				obs_data_release(data);
+			}
+		}
+		caps_loaded = true;
+	}
+
+	size_t ix = allow_he_aac ? 1 : 0;
+	return caps_available[ix] ? &caps[ix] : nullptr;
+}
@@ -0,0 +1,44 @@
+/*
+ * OBS CoreAudio Encoder Plugin for Linux
+ * Copyright (C) 2024 Norihiro Kamae <norihiro@nagater.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+/* Sample rates and bitrates available from CoreAudioToolbox.dll for one variant, either AAC-LC only or HE-AAC
+ * allowed. The lists are sorted. */
+struct ca_capabilities
+{
+	std::vector<uint32_t> samplerates;
+	std::map<uint32_t, std::vector<uint32_t>> bitrates;
+};
+
+/* Returns the capabilities, or nullptr if they are not available.
+ * The first call loads the cache file or runs the co-process to list the capabilities.
+ * While the background probe started by ca_capabilities_start is running, waits for it only if 'wait' is set. */
+const ca_capabilities *ca_capabilities_get(bool allow_he_aac, bool wait = true);
+
+extern "C" {
+/* Loads the cache file, or starts listing the capabilities in the background if there is no valid cache.
+ * Returns false only if the cache tells the encoder is not available. */
+bool ca_capabilities_start(void);
+void ca_capabilities_stop(void);
+}
@@ -0,0 +1,431 @@
+/*
+ * OBS CoreAudio Encoder Plugin for Linux
+ * Copyright (C) 2024 Norihiro Kamae <norihiro@nagater.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <obs-module.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <util/platform.h>
+#include <util/util.hpp>
+#include "plugin-macros.generated.h"
+#include "co-process.hpp"
+#include "run-proc.h"
+#include "io-util.h"
+#include "log-pump.hpp"
+
+/* Number of processes started in advance, waiting for encoder_settings */
+#define POOL_SIZE 1
+
+/* The co-process should consume a request or complete a reply within this time once it has started it. */
+#define WRITE_TIMEOUT_MS 1000
+#define READ_TIMEOUT_MS 1000
+
+/* Time given to the co-process to exit before SIGTERM, and then before SIGKILL */
+#define EXIT_TIMEOUT_NS 2000000000ULL
+
+static void reader_thread_routine(co_process *proc)
+{
+	std::vector<uint8_t> data;
+
+	while (true) {
+		struct encoder_data_header header;
+		if (!io_read_full(proc->fd_data, &header, sizeof(header), -1)) {
+			if (errno)
+				blog(LOG_ERROR, "[%s] Failed to read header from the co-process: %s",
+				     proc->get_name().c_str(), strerror(errno));
+			break;
+		}
+
+		/* A packet in the shared-memory arena has no payload in the pipe. */
+		uint32_t size = header.flags & ENCODER_FLAG_SHM ? 0 : header.size;
+		data.resize(size);
+		if (size && !io_read_full(proc->fd_data, data.data(), size, READ_TIMEOUT_MS)) {
+			blog(LOG_ERROR, "[%s] Failed to read data from the co-process: %s", proc->get_name().c_str(),
+			     errno ? strerror(errno) : "unexpected EOF");
+			break;
+		}
+
+		std::unique_lock<std::mutex> lock(proc->streams_mutex);
+		auto it = proc->streams.find(header.stream_id);
+		if (it != proc->streams.end())
+			it->second->on_reply(header, data);
+	}
+
+	std::unique_lock<std::mutex> lock(proc->streams_mutex);
+	proc->closed = true;
+	for (auto &it : proc->streams)
+		it.second->on_close();
+}
+
+co_process::~co_process()
+{
+	if (fd_req >= 0)
+		close(fd_req);
+
+	if (reader_thread.joinable())
+		reader_thread.join();
+
+	if (fd_data >= 0)
+		close(fd_data);
+
+	if (fd_err >= 0) {
+		log_pump_remove(fd_err);
+		close(fd_err);
+	}
+}
+
+std::string co_process::get_name()
+{
+	std::unique_lock<std::mutex> lock(name_mutex);
+	return name;
+}
+
+void co_process::set_name(const char *name_)
+{
+	std::unique_lock<std::mutex> lock(name_mutex);
+	name = name_;
+}
+
+bool co_process::start(const char *name_, const struct run_proc_sched *sched)
+{
+	set_name(name_);
+
+	BPtr<char> proc_path = obs_module_file("obs-coreaudio-encoder-proc.exe");
+	pid = run_proc_with_sched(proc_path, &fd_req, &fd_data, &fd_err, "-s", sched);
+	if (pid < 0) {
+		blog(LOG_ERROR, "Failed to create Wine process for '%s'", proc_path.Get());
+		return false;
+	}
+
+	/* Non-blocking so that the timeouts also apply to writes and reads larger than PIPE_BUF. */
+	fcntl(fd_req, F_SETFL, fcntl(fd_req, F_GETFL) | O_NONBLOCK);
+	fcntl(fd_data, F_SETFL, fcntl(fd_data, F_GETFL) | O_NONBLOCK);
+
+	/* A pipe that nobody reads would block the co-process once it is full, its writes fail after the close. */
+	if (!log_pump_add(fd_err, [this] { return get_name(); })) {
+		blog(LOG_WARNING, "[%s] Messages from the co-process will not be logged", name_);
+		close(fd_err);
+		fd_err = -1;
+	}
+	reader_thread = std::thread([this] { reader_thread_routine(this); });
+
+	return true;
+}
+
+uint32_t co_process::add_stream(co_process_stream *stream)
+{
+	std::unique_lock<std::mutex> lock(streams_mutex);
+
+	if (closed)
+		return 0;
+
+	uint32_t stream_id = next_stream_id++;
+	streams[stream_id] = stream;
+	return stream_id;
+}
+
+void co_process::remove_stream(uint32_t stream_id)
+{
+	std::unique_lock<std::mutex> lock(streams_mutex);
+	streams.erase(stream_id);
+}
+
+bool co_process::write(const struct encoder_data_header &header, const uint8_t *data, const char *msg)
+{
+	std::unique_lock<std::mutex> lock(write_mutex);
+
+	if (fd_req < 0)
+		return false;
+
+	const char *failed = nullptr;
+	if (!io_write_full(fd_req, &header, sizeof(header), WRITE_TIMEOUT_MS))
+		failed = "header";
+	else if (header.size && !(header.flags & ENCODER_FLAG_SHM) &&
+		 !io_write_full(fd_req, data, header.size, WRITE_TIMEOUT_MS))
+		failed = "data";
+
+	if (failed) {
+		blog(LOG_ERROR, "[%s] Failed to write %s for %s: %s", get_name().c_str(), failed, msg, strerror(errno));
+
+		/* A partially written request cannot be recovered. Closing the pipe also tells the co-process to
+		 * exit so that the reader thread notifies every stream. */
+		close(fd_req);
+		fd_req = -1;
+		return false;
+	}
+
+	return true;
+}
+
+void co_process::terminate()
+{
+	std::unique_lock<std::mutex> lock(write_mutex);
+
+	if (fd_req >= 0) {
+		close(fd_req);
+		fd_req = -1;
+	}
+
+	if (pid > 0)
+		kill(pid, SIGKILL);
+}
+
+static std::mutex reaper_mutex;
+static std::condition_variable reaper_cond;
+static std::deque<co_process *> reaper_queue;
+static std::thread reaper_thread;
+static bool reaper_stopping = false;
+
+/* Child processes other than co-processes, such as the wineserver. They exit by themselves and are polled by the
+ * reaper thread so that none of them stays a zombie. */
+static std::vector<pid_t> reaper_pids;
+#define REAP_PID_INTERVAL_MS 1000
+
+static bool wait_exit(pid_t pid, uint64_t timeout_ns)
+{
+	uint64_t deadline = os_gettime_ns() + timeout_ns;
+
+	while (true) {
+		int wstatus = 0;
+		pid_t ret = waitpid(pid, &wstatus, WNOHANG);
+		if (ret == pid || (ret < 0 && errno != EINTR))
+			return true;
+		if (os_gettime_ns() >= deadline)
+			return false;
+		os_sleep_ms(10);
+	}
+}
+
+static void reap(co_process *proc)
+{
+	std::unique_lock<std::mutex> lock(proc->write_mutex);
+	if (proc->fd_req >= 0) {
+		/* The co-process exits when the request pipe is closed. */
+		close(proc->fd_req);
+		proc->fd_req = -1;
+	}
+	lock.unlock();
+
+	if (proc->pid > 0) {
+		if (!wait_exit(proc->pid, EXIT_TIMEOUT_NS)) {
+			blog(LOG_WARNING, "[%s] process %d did not exit, sending SIGTERM", proc->get_name().c_str(),
+			     (int)proc->pid);
+			kill(proc->pid, SIGTERM);
+			if (!wait_exit(proc->pid, EXIT_TIMEOUT_NS)) {
+				blog(LOG_WARNING, "[%s] process %d did not exit, sending SIGKILL",
+				     proc->get_name().c_str(), (int)proc->pid);
+				kill(proc->pid, SIGKILL);
+				waitpid(proc->pid, NULL, 0);
+			}
+		}
+		blog(LOG_INFO, "[%s] process %d terminated", proc->get_name().c_str(), (int)proc->pid);
+		proc->pid = -1;
+	}
+
+	delete proc;
+}
+
+/* Requires reaper_mutex */
+static void reap_pids()
+{
+	for (size_t i = 0; i < reaper_pids.size();) {
+		pid_t ret = waitpid(reaper_pids[i], NULL, WNOHANG);
+		if (ret == reaper_pids[i] || (ret < 0 && errno != EINTR)) {
+			blog(LOG_INFO, "process %d exited", (int)reaper_pids[i]);
+			reaper_pids.erase(reaper_pids.begin() + i);
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+static void reaper_thread_routine()
+{
+	std::unique_lock<std::mutex> lock(reaper_mutex);
+
+	while (true) {
+		auto ready = [] { return reaper_queue.size() || reaper_stopping; };
+		if (reaper_pids.size())
+			reaper_cond.wait_for(lock, std::chrono::milliseconds(REAP_PID_INTERVAL_MS), ready);
+		else
+			reaper_cond.wait(lock, ready);
+
+		reap_pids();
+
+		if (!reaper_queue.size()) {
+			if (reaper_stopping)
+				return;
+			continue;
+		}
+
+		co_process *proc = reaper_queue.front();
+		reaper_queue.pop_front();
+
+		lock.unlock();
+		reap(proc);
+		lock.lock();
+	}
+}
+
+void co_process_reap(co_process *proc)
+{
+	std::unique_lock<std::mutex> lock(reaper_mutex);
+
+	if (reaper_stopping) {
+		lock.unlock();
+		reap(proc);
+		return;
+	}
+
+	if (!reaper_thread.joinable())
+		reaper_thread = std::thread(reaper_thread_routine);
+
+	reaper_queue.push_back(proc);
+	reaper_cond.notify_one();
+}
+
+extern "C" void co_process_reap_pid(pid_t pid)
+{
+	if (pid <= 0)
+		return;
+
+	std::unique_lock<std::mutex> lock(reaper_mutex);
+
+	if (reaper_stopping) {
+		waitpid(pid, NULL, WNOHANG);
+		return;
+	}
+
+	if (!reaper_thread.joinable())
+		reaper_thread = std::thread(reaper_thread_routine);
+
+	reaper_pids.push_back(pid);
+	reaper_cond.notify_one();
+}
+
+std::shared_ptr<co_process> co_process_create(const char *name, const struct run_proc_sched *sched)
+{
+	std::shared_ptr<co_process> proc(new co_process(), co_process_reap);
+
+	if (!proc->start(name, sched))
+		return nullptr;
+
+	return proc;
+}
+
+std::shared_ptr<co_process> co_process_get_shared()
+{
+	static std::mutex mutex;
+	static std::weak_ptr<co_process> shared;
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	std::shared_ptr<co_process> proc = shared.lock();
+	if (proc) {
+		std::unique_lock<std::mutex> streams_lock(proc->streams_mutex);
+		if (!proc->closed)
+			return proc;
+	}
+
+	proc = co_process_acquire("shared");
+	shared = proc;
+	return proc;
+}
+
+static std::mutex pool_mutex;
+static std::vector<std::shared_ptr<co_process>> pool;
+static bool pool_enabled = false;
+
+static void pool_fill(std::unique_lock<std::mutex> &)
+{
+	while (pool_enabled && pool.size() < POOL_SIZE) {
+		std::shared_ptr<co_process> proc = co_process_create("standby");
+		if (!proc)
+			return;
+		pool.push_back(proc);
+	}
+}
+
+std::shared_ptr<co_process> co_process_acquire(const char *name, const struct run_proc_sched *sched)
+{
+	if (!run_proc_sched_is_default(sched))
+		return co_process_create(name, sched);
+
+	std::unique_lock<std::mutex> lock(pool_mutex);
+
+	while (pool.size()) {
+		std::shared_ptr<co_process> proc = pool.front();
+		pool.erase(pool.begin());
+
+		std::unique_lock<std::mutex> streams_lock(proc->streams_mutex);
+		if (proc->closed)
+			continue;
+		streams_lock.unlock();
+
+		blog(LOG_INFO, "[%s] Using pre-started process %d", name, (int)proc->pid);
+		proc->set_name(name);
+
+		/* Start the next one now so that it has time to boot before it is needed. */
+		pool_fill(lock);
+		return proc;
+	}
+
+	lock.unlock();
+	return co_process_create(name);
+}
+
+extern "C" void co_process_pool_start(void)
+{
+	std::unique_lock<std::mutex> lock(pool_mutex);
+	pool_enabled = true;
+	pool_fill(lock);
+}
+
+extern "C" void co_process_pool_stop(void)
+{
+	std::vector<std::shared_ptr<co_process>> procs;
+
+	std::unique_lock<std::mutex> lock(pool_mutex);
+	pool_enabled = false;
+	procs.swap(pool);
+	lock.unlock();
+
+	procs.clear();
+}
+
+extern "C" void co_process_reaper_stop(void)
+{
+	std::unique_lock<std::mutex> lock(reaper_mutex);
+	reaper_stopping = true;
+	reaper_cond.notify_one();
+	lock.unlock();
+
+	if (reaper_thread.joinable())
+		reaper_thread.join();
+
+	/* The processes still running are left to exit by themselves. */
+	lock.lock();
+	reap_pids();
+}
@@ -0,0 +1,102 @@
+/*
+ * OBS CoreAudio Encoder Plugin for Linux
+ * Copyright (C) 2024 Norihiro Kamae <norihiro@nagater.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "encoder-proc/encoder-proc.h"
+#include "run-proc.h"
+
+/* An encoder instance hosted by a co_process */
+struct co_process_stream
+{
+	virtual ~co_process_stream() = default;
+
+	virtual const char *name() const = 0;
+
+	/* Called from the reader thread. The stream may take the content of 'data'. */
+	virtual void on_reply(const struct encoder_data_header &header, std::vector<uint8_t> &data) = 0;
+
+	/* Called from the reader thread when the co-process has closed the pipe. */
+	virtual void on_close() = 0;
+};
+
+/*
+ * The Wine process running obs-coreaudio-encoder-proc.exe in the server mode.
+ * A process is either dedicated to one encoder or shared by all encoders that enable it.
+ */
+struct co_process
+{
+	std::mutex name_mutex;
+	std::string name;
+
+	pid_t pid = -1;
+	int fd_req = -1;
+	int fd_data = -1;
+	int fd_err = -1;
+
+	std::mutex write_mutex;
+
+	std::mutex streams_mutex;
+	std::map<uint32_t, co_process_stream *> streams;
+	uint32_t next_stream_id = 1;
+	bool closed = false;
+
+	std::thread reader_thread;
+
+	~co_process();
+
+	bool start(const char *name_, const struct run_proc_sched *sched = nullptr);
+
+	std::string get_name();
+	void set_name(const char *name_);
+
+	/* Returns the stream ID, or 0 if the process has already exited. */
+	uint32_t add_stream(co_process_stream *stream);
+	void remove_stream(uint32_t stream_id);
+
+	bool write(const struct encoder_data_header &header, const uint8_t *data, const char *msg);
+
+	/* Kills a process that has stopped responding. The reader thread then notifies every stream. */
+	void terminate();
+};
+
+/* Deleter of co_process. The process is waited for, and the object is deleted, by a background thread so that
+ * releasing the last reference does not block. */
+void co_process_reap(co_process *proc);
+
+std::shared_ptr<co_process> co_process_create(const char *name, const struct run_proc_sched *sched = nullptr);
+std::shared_ptr<co_process> co_process_get_shared();
+
+/* Takes a pre-started process from the pool, or starts a new one.
+ * The pool runs with the default scheduling, so a process with 'sched' is always started here. */
+std::shared_ptr<co_process> co_process_acquire(const char *name, const struct run_proc_sched *sched = nullptr);
+
+extern "C" void co_process_pool_start(void);
+extern "C" void co_process_pool_stop(void);
+extern "C" void co_process_reaper_stop(void);
+
+/* Waits on the reaper thread for a child process that is not a co-process, without signaling it. */
+extern "C" void co_process_reap_pid(pid_t pid);
@@ -0,0 +1,106 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <util/platform.h>
+#include "io-util.h"
+
+static inline uint64_t get_deadline(int timeout_ms)
+{
+	return timeout_ms < 0 ? 0 : os_gettime_ns() + (uint64_t)timeout_ms * 1000000;
+}
+
+/* Waits until 'fd' is ready or the deadline is reached. Zero deadline means no deadline. */
+static bool wait_fd(int fd, short events, uint64_t deadline)
+{
+	while (true) {
+		int timeout = -1;
+		if (deadline) {
+			uint64_t now = os_gettime_ns();
+			if (now >= deadline) {
+				errno = ETIMEDOUT;
+				return false;
+			}
+			timeout = (int)((deadline - now + 999999) / 1000000);
+		}
+
+		struct pollfd pfd = {.fd = fd, .events = events, .revents = 0};
+		int ret = poll(&pfd, 1, timeout);
+		if (ret > 0)
+			return true; // POLLHUP and POLLERR are reported by the following read or write.
+		if (ret < 0 && errno != EINTR)
+			return false;
+	}
+}
+
+bool io_read_full(int fd, void *buf, size_t size, int timeout_ms)
+{
+	uint64_t deadline = get_deadline(timeout_ms);
+	uint8_t *p = buf;
+
+	while (size) {
+		if (deadline && !wait_fd(fd, POLLIN, deadline))
+			return false;
+
+		ssize_t n = read(fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && wait_fd(fd, POLLIN, deadline))
+				continue;
+			return false;
+		}
+		if (n == 0) {
+			errno = 0;
+			return false;
+		}
+
+		p += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+bool io_write_full(int fd, const void *buf, size_t size, int timeout_ms)
+{
+	uint64_t deadline = get_deadline(timeout_ms);
+	const uint8_t *p = buf;
+
+	while (size) {
+		if (deadline && !wait_fd(fd, POLLOUT, deadline))
+			return false;
+
+		ssize_t n = write(fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && wait_fd(fd, POLLOUT, deadline))
+				continue;
+			return false;
+		}
+
+		p += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+ssize_t io_read_some(int fd, void *buf, size_t size, int timeout_ms)
+{
+	uint64_t deadline = get_deadline(timeout_ms);
+
+	while (true) {
+		if (deadline && !wait_fd(fd, POLLIN, deadline))
+			return -1;
+
+		ssize_t n = read(fd, buf, size);
+		if (n >= 0)
+			return n;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN && wait_fd(fd, POLLIN, deadline))
+			continue;
+		return -1;
+	}
+}
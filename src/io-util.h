@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A negative timeout waits forever.
+ * On timeout, errno is set to ETIMEDOUT. On EOF, errno is set to 0. */
+
+/* Reads exactly 'size' bytes, looping over short reads. */
+bool io_read_full(int fd, void *buf, size_t size, int timeout_ms);
+
+/* Writes exactly 'size' bytes, looping over short writes. */
+bool io_write_full(int fd, const void *buf, size_t size, int timeout_ms);
+
+/* Reads whatever is available, at most 'size' bytes. Returns 0 on EOF and -1 on error or timeout. */
+ssize_t io_read_some(int fd, void *buf, size_t size, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
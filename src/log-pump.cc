@@ -0,0 +1,273 @@
+/*
+ * OBS CoreAudio Encoder Plugin for Linux
+ * Copyright (C) 2024 Norihiro Kamae <norihiro@nagater.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <obs-module.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <util/platform.h>
+#include "plugin-macros.generated.h"
+#include "log-pump.hpp"
+
+/* A longer line is logged in pieces of this size. */
+#define LOG_LINE_SIZE 1024
+
+/* At most FIXME_LINES_MAX lines of Wine 'fixme' messages are logged per FIXME_INTERVAL_NS for each process. */
+#define FIXME_LINES_MAX 20
+#define FIXME_INTERVAL_NS 10000000000ULL
+
+#define EPOLL_EVENTS_MAX 16
+
+struct log_source
+{
+	int fd = -1;
+	std::function<std::string()> get_name;
+	bool eof = false;
+
+	char line[LOG_LINE_SIZE];
+	size_t len = 0;
+
+	uint64_t fixme_start_ns = 0;
+	uint32_t fixme_lines = 0;
+	uint32_t fixme_suppressed = 0;
+};
+
+static std::mutex pump_mutex;
+static std::map<int, std::unique_ptr<log_source>> sources;
+static std::thread pump_thread;
+static int epoll_fd = -1;
+static int wake_fd = -1;
+static bool pump_stopping = false;
+
+static inline bool is_fixme(const char *line)
+{
+	/* Wine prefixes the messages with the thread ID as "0024:fixme:class:function ..." */
+	return strncmp(line, "fixme:", 6) == 0 || strstr(line, ":fixme:");
+}
+
+static void flush_suppressed(log_source &src)
+{
+	if (src.fixme_suppressed)
+		blog(LOG_INFO, "[%s] pipe: %u fixme lines suppressed", src.get_name().c_str(), src.fixme_suppressed);
+	src.fixme_suppressed = 0;
+}
+
+static void log_line(log_source &src, const char *line)
+{
+	if (is_fixme(line)) {
+		uint64_t now = os_gettime_ns();
+		if (now - src.fixme_start_ns >= FIXME_INTERVAL_NS) {
+			flush_suppressed(src);
+			src.fixme_start_ns = now;
+			src.fixme_lines = 0;
+		}
+		if (src.fixme_lines >= FIXME_LINES_MAX) {
+			src.fixme_suppressed++;
+			return;
+		}
+		src.fixme_lines++;
+	}
+
+	blog(LOG_INFO, "[%s] pipe: %s", src.get_name().c_str(), line);
+}
+
+/* Logs the complete lines in the buffer and keeps the last incomplete one. */
+static void log_lines(log_source &src)
+{
+	size_t start = 0;
+	for (size_t i = 0; i < src.len; i++) {
+		if (src.line[i] == '\n') {
+			src.line[i] = 0;
+			log_line(src, src.line + start);
+			start = i + 1;
+		}
+	}
+
+	if (start) {
+		memmove(src.line, src.line + start, src.len - start);
+		src.len -= start;
+	}
+	else if (src.len == sizeof(src.line) - 1) {
+		src.line[src.len] = 0;
+		log_line(src, src.line);
+		src.len = 0;
+	}
+}
+
+static void log_remaining(log_source &src)
+{
+	if (src.len) {
+		src.line[src.len] = 0;
+		log_line(src, src.line);
+		src.len = 0;
+	}
+	flush_suppressed(src);
+}
+
+/* Reads until the pipe is empty. Called with pump_mutex locked. */
+static void drain(log_source &src)
+{
+	while (!src.eof) {
+		ssize_t n = read(src.fd, src.line + src.len, sizeof(src.line) - 1 - src.len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+
+		if (n <= 0) {
+			log_remaining(src);
+			blog(LOG_INFO, "[%s] pipe closed", src.get_name().c_str());
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, src.fd, NULL);
+			src.eof = true;
+			return;
+		}
+
+		src.len += (size_t)n;
+		log_lines(src);
+	}
+}
+
+static void pump_thread_routine()
+{
+	struct epoll_event events[EPOLL_EVENTS_MAX];
+
+	while (true) {
+		int n = epoll_wait(epoll_fd, events, EPOLL_EVENTS_MAX, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			blog(LOG_ERROR, "Log pump failed to wait for the pipes: %s", strerror(errno));
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(pump_mutex);
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.fd == wake_fd) {
+				if (pump_stopping)
+					return;
+				continue;
+			}
+
+			auto it = sources.find(events[i].data.fd);
+			if (it != sources.end())
+				drain(*it->second);
+		}
+	}
+}
+
+/* Called with pump_mutex locked. */
+static bool pump_start()
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		blog(LOG_ERROR, "Log pump failed to create epoll: %s", strerror(errno));
+		return false;
+	}
+
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = wake_fd;
+	if (wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) {
+		blog(LOG_ERROR, "Log pump failed to create eventfd: %s", strerror(errno));
+		if (wake_fd >= 0)
+			close(wake_fd);
+		close(epoll_fd);
+		wake_fd = epoll_fd = -1;
+		return false;
+	}
+
+	pump_thread = std::thread(pump_thread_routine);
+	return true;
+}
+
+bool log_pump_add(int fd, std::function<std::string()> get_name)
+{
+	std::unique_lock<std::mutex> lock(pump_mutex);
+
+	if (epoll_fd < 0 && !pump_start())
+		return false;
+
+	std::unique_ptr<log_source> src(new log_source());
+	src->fd = fd;
+	src->get_name = std::move(get_name);
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		blog(LOG_ERROR, "Log pump failed to add the pipe: %s", strerror(errno));
+		return false;
+	}
+
+	sources[fd] = std::move(src);
+	return true;
+}
+
+void log_pump_remove(int fd)
+{
+	std::unique_lock<std::mutex> lock(pump_mutex);
+
+	auto it = sources.find(fd);
+	if (it == sources.end())
+		return;
+
+	log_source &src = *it->second;
+	if (!src.eof) {
+		drain(src);
+		if (!src.eof) {
+			log_remaining(src);
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		}
+	}
+
+	sources.erase(it);
+}
+
+extern "C" void log_pump_stop(void)
+{
+	std::unique_lock<std::mutex> lock(pump_mutex);
+	if (epoll_fd < 0)
+		return;
+
+	pump_stopping = true;
+	uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof(one)) < 0)
+		blog(LOG_ERROR, "Log pump failed to wake up: %s", strerror(errno));
+	lock.unlock();
+
+	if (pump_thread.joinable())
+		pump_thread.join();
+
+	lock.lock();
+	sources.clear();
+	close(wake_fd);
+	close(epoll_fd);
+	wake_fd = epoll_fd = -1;
+	pump_stopping = false;
+}
@@ -0,0 +1,36 @@
+/*
+ * OBS CoreAudio Encoder Plugin for Linux
+ * Copyright (C) 2024 Norihiro Kamae <norihiro@nagater.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+/*
+ * One thread logs the stderr of every co-process.
+ * Each line is logged with the name returned by 'get_name', which is called from the pump thread.
+ * On failure, 'fd' is not watched, and the caller has to close it so that the writer does not block on it.
+ */
+bool log_pump_add(int fd, std::function<std::string()> get_name);
+
+/* Logs what is left in 'fd' and stops watching it. 'get_name' is not called after this returns.
+ * The caller still owns 'fd'. */
+void log_pump_remove(int fd);
+
+extern "C" void log_pump_stop(void);
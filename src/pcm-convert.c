@@ -0,0 +1,58 @@
+#include <math.h>
+#include "pcm-convert.h"
+
+/* ARMv7 NEON only converts toward zero, so 32-bit ARM takes the scalar loop to round the same way. */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+static inline int16_t float_to_s16(float v)
+{
+	float s = v * 32768.0f;
+	if (s >= 32767.0f)
+		return 32767;
+	if (s <= -32768.0f)
+		return -32768;
+	return (int16_t)lrintf(s);
+}
+
+void pcm_float_to_s16(int16_t *dst, const float *src, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128 scale = _mm_set1_ps(32768.0f);
+	const __m128 max = _mm_set1_ps(32767.0f);
+	for (; i + 8 <= n; i += 8) {
+		/* cvtps rounds to nearest and turns values out of the int32 range into INT32_MIN, so only the positive
+		 * side needs clamping before packs saturates to int16. */
+		__m128 lo = _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(src + i), scale), max);
+		__m128 hi = _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale), max);
+		__m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+		_mm_storeu_si128((__m128i *)(dst + i), packed);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 8 <= n; i += 8) {
+		float32x4_t lo = vmulq_n_f32(vld1q_f32(src + i), 32768.0f);
+		float32x4_t hi = vmulq_n_f32(vld1q_f32(src + i + 4), 32768.0f);
+		int32x4_t lo_i = vcvtnq_s32_f32(lo);
+		int32x4_t hi_i = vcvtnq_s32_f32(hi);
+		vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(lo_i), vqmovn_s32(hi_i)));
+	}
+#endif
+
+	for (; i < n; i++)
+		dst[i] = float_to_s16(src[i]);
+}
+
+void pcm_remap_interleaved(float *dst, const float *src, size_t frames, size_t channels, const int32_t *map)
+{
+	for (size_t i = 0; i < frames; i++) {
+		for (size_t c = 0; c < channels; c++)
+			dst[c] = src[map[c]];
+		dst += channels;
+		src += channels;
+	}
+}
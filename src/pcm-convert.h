@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Converts float samples in [-1, 1] to signed 16-bit integers, rounding to nearest and saturating. */
+void pcm_float_to_s16(int16_t *dst, const float *src, size_t n);
+
+/* Reorders interleaved float frames so that output channel i is the input channel map[i]. */
+void pcm_remap_interleaved(float *dst, const float *src, size_t frames, size_t channels, const int32_t *map);
+
+#ifdef __cplusplus
+}
+#endif
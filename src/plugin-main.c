@@ -19,12 +19,19 @@
 
 #include <obs-module.h>
 #include "plugin-macros.generated.h"
+#include "run-proc.h"
 
 OBS_DECLARE_MODULE()
 OBS_MODULE_USE_DEFAULT_LOCALE(PLUGIN_NAME, "en-US")
 
 void register_aac_info();
-obs_properties_t *aac_properties(void *data);
+bool ca_capabilities_start(void);
+void ca_capabilities_stop(void);
+void co_process_pool_start(void);
+void co_process_pool_stop(void);
+void co_process_reaper_stop(void);
+void co_process_reap_pid(pid_t pid);
+void log_pump_stop(void);
 
 MODULE_EXPORT const char *obs_module_description(void)
 {
@@ -33,15 +40,30 @@ MODULE_EXPORT const char *obs_module_description(void)
 
 bool obs_module_load(void)
 {
-	obs_properties_t *prop = aac_properties(NULL);
-	if (!prop) {
+#ifdef PERSISTENT_WINESERVER
+	/* Started first so that the capability query and every encoder skip the startup of the wineserver.
+	 * It exits by itself once no Wine process is left, and is only reaped here. */
+	co_process_reap_pid(run_proc_start_wineserver());
+#endif
+
+	if (!ca_capabilities_start()) {
 		blog(LOG_ERROR, "CoreAudio AAC encoder not installed on the system or couldn't be loaded");
+		co_process_reaper_stop();
 		return false;
 	}
-	obs_properties_destroy(prop);
 
 	register_aac_info();
 
+	co_process_pool_start();
+
 	blog(LOG_INFO, "plugin loaded (version %s)", PLUGIN_VERSION);
 	return true;
 }
+
+void obs_module_unload(void)
+{
+	co_process_pool_stop();
+	co_process_reaper_stop();
+	log_pump_stop();
+	ca_capabilities_stop();
+}
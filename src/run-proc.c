@@ -1,15 +1,146 @@
-#define _GNU_SOURCE // close_range, pipe2
+#define _GNU_SOURCE // close_range, pipe2, sched_setaffinity, posix_spawn_file_actions_addclosefrom_np
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
 #include <obs-module.h>
 #include <util/platform.h>
 #include <util/threading.h>
 #include <util/darray.h>
 #include "plugin-macros.generated.h"
+#include "run-proc.h"
+
+/* How long the wineserver started by run_proc_start_wineserver waits for a new client, passed as '-p' */
+#define WINESERVER_PERSIST_SECONDS "60"
+
+/* Runs in the child after fork. Failures are reported to the stderr of the child, which is in the OBS log. */
+static void apply_sched(const struct run_proc_sched *sched)
+{
+	if (sched->nice) {
+		errno = 0;
+		if (nice(sched->nice) == -1 && errno)
+			fprintf(stderr, "Warning: failed to change the nice level by %d: %s\n", sched->nice,
+				strerror(errno));
+	}
+
+#ifdef __linux__
+	if (sched->cpu_mask) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int i = 0; i < 64; i++) {
+			if (sched->cpu_mask & (1ULL << i))
+				CPU_SET(i, &set);
+		}
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			fprintf(stderr, "Warning: failed to set the CPU affinity: %s\n", strerror(errno));
+	}
+
+	if (sched->fifo_priority > 0) {
+		/* Reset on fork so that a wineserver started by this process does not run as real-time. */
+		struct sched_param param = {.sched_priority = sched->fifo_priority};
+		if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) < 0)
+			fprintf(stderr, "Warning: failed to set SCHED_FIFO priority %d: %s\n", sched->fifo_priority,
+				strerror(errno));
+	}
+#endif
+}
+
+/* Copies the environment of OBS with the variables Wine needs. Only the array is allocated. */
+static char **wine_environ(void)
+{
+	size_t n = 0;
+	while (environ[n])
+		n++;
+
+	char **envp = bmalloc((n + 3) * sizeof(char *));
+	memcpy(envp, environ, n * sizeof(char *));
+#ifdef ENV_WINEPATH
+	if (!getenv("WINEPATH"))
+		envp[n++] = (char *)"WINEPATH=" ENV_WINEPATH;
+#endif
+	if (!getenv("WINEDEBUG"))
+		envp[n++] = (char *)"WINEDEBUG=fixme-all";
+	envp[n] = NULL;
+
+	return envp;
+}
+
+/* posix_spawn avoids copying the page tables of OBS but cannot close the descriptors that lack O_CLOEXEC. */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define HAVE_SPAWN_CLOSEFROM
+#endif
+
+/* 'child_fds' are duplicated to the standard input, output, and error of the child if not -1. */
+static pid_t spawn(char *const argv[], const int child_fds[3], const struct run_proc_sched *sched)
+{
+	char **envp = wine_environ();
+	pid_t pid = -1;
+
+#ifdef HAVE_SPAWN_CLOSEFROM
+	if (run_proc_sched_is_default(sched)) {
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		for (int i = 0; i < 3; i++) {
+			if (child_fds[i] >= 0)
+				posix_spawn_file_actions_adddup2(&actions, child_fds[i], i);
+		}
+		posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+
+		int ret = posix_spawnp(&pid, argv[0], &actions, NULL, argv, envp);
+		posix_spawn_file_actions_destroy(&actions);
+		bfree(envp);
+
+		if (ret) {
+			blog(LOG_ERROR, "failed to spawn \"%s\": %s", argv[0], strerror(ret));
+			return -1;
+		}
+		return pid;
+	}
+#endif
+
+	pid = fork();
+	if (pid < 0) {
+		blog(LOG_ERROR, "failed to fork");
+		bfree(envp);
+		return -1;
+	}
+
+	if (pid == 0) {
+		// I'm a child
+		for (int i = 0; i < 3; i++) {
+			if (child_fds[i] >= 0)
+				dup2(child_fds[i], i);
+		}
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__DragonFly__)
+		closefrom(3);
+#else // Linux
+		close_range(3, 65535, 0);
+#endif
+		if (!run_proc_sched_is_default(sched))
+			apply_sched(sched);
+		environ = envp;
+		execvp(argv[0], argv);
+		fprintf(stderr, "Error: failed to exec \"%s\"\n", argv[0]);
+		_exit(1);
+	}
+
+	bfree(envp);
+	return pid;
+}
 
 pid_t run_proc(const char *proc_path, int *fd_in, int *fd_out, int *fd_err, const char *arg1)
+{
+	return run_proc_with_sched(proc_path, fd_in, fd_out, fd_err, arg1, NULL);
+}
+
+pid_t run_proc_with_sched(const char *proc_path, int *fd_in, int *fd_out, int *fd_err, const char *arg1,
+			  const struct run_proc_sched *sched)
 {
 	int pipe_in[2] = {-1, -1};
 	int pipe_out[2] = {-1, -1};
@@ -30,43 +161,11 @@ pid_t run_proc(const char *proc_path, int *fd_in, int *fd_out, int *fd_err, cons
 		goto fail2;
 	}
 
-	pid_t pid = fork();
-	if (pid < 0) {
-		blog(LOG_ERROR, "failed to fork");
+	char *const argv[] = {(char *)WINE_EXE_PATH, (char *)proc_path, (char *)arg1, NULL};
+	const int child_fds[3] = {pipe_in[0], pipe_out[1], pipe_err[1]};
+	pid_t pid = spawn(argv, child_fds, sched);
+	if (pid < 0)
 		goto fail3;
-	}
-
-	if (pid == 0) {
-		// I'm a child
-		if (pipe_in[0] >= 0) {
-			dup2(pipe_in[0], 0);
-			close(pipe_in[0]);
-			close(pipe_in[1]);
-		}
-		if (pipe_out[0] >= 0) {
-			dup2(pipe_out[1], 1);
-			close(pipe_out[0]);
-			close(pipe_out[1]);
-		}
-		if (pipe_err[0] >= 0) {
-			dup2(pipe_err[1], 2);
-			close(pipe_err[0]);
-			close(pipe_err[1]);
-		}
-#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__DragonFly__)
-		closefrom(3);
-#else // Linux
-		close_range(3, 65535, 0);
-#endif
-#ifdef ENV_WINEPATH
-		setenv("WINEPATH", ENV_WINEPATH, 0);
-#endif
-		setenv("WINEDEBUG", "fixme-all", 0);
-		if (execlp(WINE_EXE_PATH, WINE_EXE_PATH, proc_path, arg1, NULL) < 0) {
-			fprintf(stderr, "Error: failed to exec \"%s\"\n", proc_path);
-			exit(1);
-		}
-	}
 
 	if (fd_in) {
 		*fd_in = pipe_in[1];
@@ -103,3 +202,49 @@ fail1:
 
 	return -1;
 }
+
+pid_t run_proc_start_wineserver(void)
+{
+	/* In the foreground so that the returned process is the server itself. If a server is already running for
+	 * the prefix, this one exits immediately and the running one is used as before.
+	 * The server is shared with any other Wine program of the prefix, so it is never signaled. Instead, it exits
+	 * by itself WINESERVER_PERSIST_SECONDS after the last Wine process has exited. */
+	char *const argv[] = {
+		(char *)WINESERVER_EXE_PATH,
+		(char *)"-f",
+		(char *)"-p" WINESERVER_PERSIST_SECONDS,
+		NULL,
+	};
+	const int child_fds[3] = {-1, -1, -1};
+	return spawn(argv, child_fds, NULL);
+}
+
+bool run_proc_parse_cpu_list(const char *list, uint64_t *mask)
+{
+	*mask = 0;
+
+	for (const char *p = list; *p;) {
+		char *end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+		if (end == p)
+			return false;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				return false;
+		}
+		if (first < 0 || last < first || last > 63)
+			return false;
+
+		for (long i = first; i <= last; i++)
+			*mask |= 1ULL << i;
+
+		p = end;
+		while (*p == ',' || *p == ' ')
+			p++;
+	}
+
+	return true;
+}
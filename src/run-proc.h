@@ -1,12 +1,37 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Scheduling of the child process, applied before exec. Zero keeps the default of each field. */
+struct run_proc_sched
+{
+	int nice;          // Added to the nice level of OBS
+	int fifo_priority; // SCHED_FIFO with this priority if positive
+	uint64_t cpu_mask; // Bit n allows CPU n
+};
+
 pid_t run_proc(const char *proc_path, int *fd_in, int *fd_out, int *fd_err, const char *arg1);
+pid_t run_proc_with_sched(const char *proc_path, int *fd_in, int *fd_out, int *fd_err, const char *arg1,
+			  const struct run_proc_sched *sched);
+
+static inline bool run_proc_sched_is_default(const struct run_proc_sched *sched)
+{
+	return !sched || (!sched->nice && sched->fifo_priority <= 0 && !sched->cpu_mask);
+}
+
+/* Starts a wineserver that stays running for a while after the last Wine process exits, so that each process
+ * started later connects to it instead of starting a new one. Returns -1 on failure.
+ * The caller has to reap the returned process without signaling it. */
+pid_t run_proc_start_wineserver(void);
+
+/* Parses a list such as "0,2-3" into a mask of CPUs 0 to 63. An empty list gives 0. */
+bool run_proc_parse_cpu_list(const char *list, uint64_t *mask);
 
 #ifdef __cplusplus
 }
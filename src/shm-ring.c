@@ -0,0 +1,152 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <obs-module.h>
+#include <util/dstr.h>
+#include "plugin-macros.generated.h"
+#include "encoder-proc/encoder-proc.h"
+#include "shm-ring.h"
+
+#define SHM_DIR "/dev/shm"
+
+bool shm_ring_create(struct shm_ring *ring, uint32_t ring_size, uint32_t arena_size)
+{
+	static volatile long counter = 0;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+
+	if (!ring_size || (ring_size & (ring_size - 1))) {
+		blog(LOG_ERROR, "shm_ring_create: ring size %u is not a power of 2", ring_size);
+		return false;
+	}
+
+	if (arena_size & (arena_size - 1)) {
+		blog(LOG_ERROR, "shm_ring_create: arena size %u is not a power of 2", arena_size);
+		return false;
+	}
+
+	struct dstr path = {0};
+	dstr_printf(&path, SHM_DIR "/" PLUGIN_NAME "-%d-%ld", (int)getpid(),
+		    __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+	if (path.len >= ENCODER_SHM_PATH_MAX) {
+		blog(LOG_ERROR, "shm_ring_create: path '%s' is too long", path.array);
+		dstr_free(&path);
+		return false;
+	}
+
+	ring->fd = open(path.array, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (ring->fd < 0) {
+		blog(LOG_ERROR, "shm_ring_create: failed to create '%s'", path.array);
+		dstr_free(&path);
+		return false;
+	}
+	ring->path = path.array;
+
+	ring->map_size = ENCODER_SHM_DATA_OFFSET + (size_t)ring_size + arena_size;
+	if (ftruncate(ring->fd, (off_t)ring->map_size) < 0) {
+		blog(LOG_ERROR, "shm_ring_create: failed to resize '%s'", ring->path);
+		goto fail;
+	}
+
+	void *ptr = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (ptr == MAP_FAILED) {
+		blog(LOG_ERROR, "shm_ring_create: failed to map '%s'", ring->path);
+		goto fail;
+	}
+
+	ring->header = (struct encoder_shm_header *)ptr;
+	ring->data = (uint8_t *)ptr + ENCODER_SHM_DATA_OFFSET;
+	ring->header->struct_size = sizeof(struct encoder_shm_header);
+	ring->header->ring_size = ring_size;
+	ring->header->read_pos = 0;
+	ring->header->arena_size = arena_size;
+	ring->header->arena_read_pos = 0;
+	ring->arena = arena_size ? ring->data + ring_size : NULL;
+
+	return true;
+
+fail:
+	shm_ring_destroy(ring);
+	return false;
+}
+
+void shm_ring_unlink(struct shm_ring *ring)
+{
+	if (!ring->path)
+		return;
+
+	unlink(ring->path);
+	bfree(ring->path);
+	ring->path = NULL;
+}
+
+void shm_ring_destroy(struct shm_ring *ring)
+{
+	shm_ring_unlink(ring);
+
+	if (ring->header)
+		munmap(ring->header, ring->map_size);
+	ring->header = NULL;
+	ring->data = NULL;
+	ring->arena = NULL;
+
+	if (ring->fd >= 0)
+		close(ring->fd);
+	ring->fd = -1;
+}
+
+bool shm_ring_write(struct shm_ring *ring, const uint8_t *data, size_t size)
+{
+	return shm_ring_write_planes(ring, &data, 1, size);
+}
+
+bool shm_ring_write_planes(struct shm_ring *ring, const uint8_t *const *planes, size_t n_planes, size_t plane_size)
+{
+	const uint32_t ring_size = ring->header->ring_size;
+	uint32_t read_pos = __atomic_load_n(&ring->header->read_pos, __ATOMIC_ACQUIRE);
+
+	if (n_planes * plane_size > ring_size - (ring->write_pos - read_pos))
+		return false;
+
+	for (size_t i = 0; i < n_planes; i++) {
+		uint32_t offset = ring->write_pos & (ring_size - 1);
+		size_t n = ring_size - offset;
+		if (n > plane_size)
+			n = plane_size;
+
+		memcpy(ring->data + offset, planes[i], n);
+		if (n < plane_size)
+			memcpy(ring->data, planes[i] + n, plane_size - n);
+
+		ring->write_pos += (uint32_t)plane_size;
+	}
+
+	return true;
+}
+
+const uint8_t *shm_ring_arena_packet(struct shm_ring *ring, const struct encoder_data_header *header, uint32_t *end_pos)
+{
+	if (!ring->arena)
+		return NULL;
+
+	const uint32_t arena_size = ring->header->arena_size;
+	uint32_t offset = ring->arena_pos & (arena_size - 1);
+	if ((header->flags & ENCODER_FLAG_SHM_WRAP) && offset) {
+		ring->arena_pos += arena_size - offset;
+		offset = 0;
+	}
+
+	if (header->size > arena_size - offset)
+		return NULL;
+
+	ring->arena_pos += header->size;
+	*end_pos = ring->arena_pos;
+	return ring->arena + offset;
+}
+
+void shm_ring_arena_release(struct shm_ring *ring, uint32_t end_pos)
+{
+	__atomic_store_n(&ring->header->arena_read_pos, end_pos, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shm_ring
+{
+	int fd;
+	char *path;
+	struct encoder_shm_header *header;
+	uint8_t *data;
+	size_t map_size;
+	uint32_t write_pos;
+
+	/* Packets encoded by the child process */
+	uint8_t *arena;
+	uint32_t arena_pos;
+};
+
+struct encoder_data_header;
+
+bool shm_ring_create(struct shm_ring *ring, uint32_t ring_size, uint32_t arena_size);
+void shm_ring_unlink(struct shm_ring *ring);
+void shm_ring_destroy(struct shm_ring *ring);
+bool shm_ring_write(struct shm_ring *ring, const uint8_t *data, size_t size);
+
+/* Writes the planes one after another, either all of them or nothing. */
+bool shm_ring_write_planes(struct shm_ring *ring, const uint8_t *const *planes, size_t n_planes, size_t plane_size);
+
+/* Locates the packet of a reply with ENCODER_FLAG_SHM in the arena and returns NULL if it does not fit.
+ * The packets have to be located in the order of the replies. */
+const uint8_t *shm_ring_arena_packet(struct shm_ring *ring, const struct encoder_data_header *header,
+				     uint32_t *end_pos);
+
+/* Lets the child process reuse the arena up to end_pos. */
+void shm_ring_arena_release(struct shm_ring *ring, uint32_t end_pos);
+
+#ifdef __cplusplus
+}
+#endif
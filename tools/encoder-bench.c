@@ -0,0 +1,797 @@
+/*
+ * OBS CoreAudio Encoder Plugin for Linux
+ * Copyright (C) 2024 Norihiro Kamae <norihiro@nagater.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Runs obs-coreaudio-encoder-proc.exe outside OBS and measures its throughput.
+ * The encoder is driven through the same protocol as the plugin, one request at a time, as fast as possible.
+ * With the null encoder (option '-N'), only the transport is measured, and CoreAudio does not have to be installed.
+ * The fuzz mode (option '-F') sends malformed requests instead and checks that the process never crashes or hangs.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <util/platform.h>
+#include "encoder-proc/encoder-proc.h"
+#include "encoder-proc/encoder-proc-version.h"
+#include "run-proc.h"
+#include "io-util.h"
+#include "shm-ring.h"
+#include "wav-reader.h"
+
+#define FRAME_SAMPLES 1024
+
+/* Same sizes as the plugin */
+#define SHM_RING_SIZE (1 << 20)
+#define SHM_ARENA_SIZE (1 << 18)
+
+/* A fuzz session fails if the process neither consumes a request nor exits within this time. */
+#define FUZZ_TIMEOUT_MS 5000
+#define FUZZ_PAYLOAD_MAX 65536
+
+struct bench_options
+{
+	const char *proc_path;
+	const char *wav_path;
+	uint32_t channels;
+	uint32_t samplerate;
+	uint32_t samplerate_out;
+	uint32_t bitrate;
+	bool he_aac;
+	uint32_t quality;
+	uint32_t rate_control;
+	double duration;
+	uint32_t frames_per_request;
+	bool null_encoder;
+	bool shm;
+	uint32_t hold_requests;
+	uint32_t fuzz_messages;
+	uint64_t fuzz_seed;
+};
+
+struct pcm_source
+{
+	float *data; // interleaved, NULL for the synthetic source
+	uint64_t samples;
+	uint64_t pos;
+	uint32_t channels;
+};
+
+/* A packet in the arena that is kept unreleased, with a copy to check that the process did not overwrite it */
+struct held_packet
+{
+	const uint8_t *data;
+	uint8_t *copy;
+	uint32_t size;
+	uint32_t end_pos;
+	uint64_t request;
+};
+
+struct packet_hold
+{
+	struct held_packet *packets;
+	size_t count;
+	size_t capacity;
+	uint64_t overwritten;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s -p obs-coreaudio-encoder-proc.exe [options]\n"
+		"  -i file.wav   Encode the WAV file (16-bit PCM or 32-bit float) instead of a synthetic tone\n"
+		"  -c channels   Channels of the synthetic tone (default: 2)\n"
+		"  -r rate       Sample rate of the synthetic tone (default: 48000)\n"
+		"  -o rate       Output sample rate, 0 to match the input (default: 0)\n"
+		"  -b kbps       Bitrate (default: 128)\n"
+		"  -H            Allow HE-AAC\n"
+		"  -q quality    Encoder quality from 0 to 127 (default: 127)\n"
+		"  -m mode       Rate control, 0 for CBR, 1 for ABR, 2 for constrained VBR (default: 0)\n"
+		"  -t seconds    Duration of the synthetic tone (default: 60)\n"
+		"  -n frames     OBS frames per request, up to 64 (default: 1)\n"
+		"  -N            Use the null encoder of the process to measure only the transport\n"
+		"  -s            Transfer the audio and the packets through shared memory\n"
+		"  -R requests   Release the packets in shared memory this many requests late and check them\n"
+		"  -F messages   Send this many malformed requests instead of encoding\n"
+		"  -S seed       Seed of the malformed requests (default: 1)\n",
+		name);
+}
+
+static bool load_wav(struct bench_options *opt, struct pcm_source *src)
+{
+	struct wav_data wav;
+	if (!wav_load(opt->wav_path, &wav))
+		return false;
+
+	src->data = wav.data;
+	src->samples = wav.samples;
+	src->channels = wav.channels;
+	opt->channels = wav.channels;
+	opt->samplerate = wav.samplerate;
+	return true;
+}
+
+/* Fills 'samples' samples, returns false at the end of the source. */
+static bool read_pcm(struct pcm_source *src, const struct bench_options *opt, float *out, uint32_t samples)
+{
+	if (src->pos >= src->samples)
+		return false;
+
+	for (uint32_t i = 0; i < samples; i++, src->pos++) {
+		for (uint32_t c = 0; c < src->channels; c++) {
+			float v = 0.0f;
+			if (src->pos < src->samples && src->data)
+				v = src->data[src->pos * src->channels + c];
+			else if (src->pos < src->samples)
+				v = 0.5f * (float)sin(2.0 * M_PI * (440.0 + 110.0 * c) * src->pos / opt->samplerate);
+			*out++ = v;
+		}
+	}
+
+	return true;
+}
+
+/* A packet in the shared-memory arena has no payload in the pipe. */
+static bool read_reply(int fd, struct encoder_data_header *header, uint8_t **buf, size_t *buf_size)
+{
+	if (!io_read_full(fd, header, sizeof(*header), -1))
+		return false;
+
+	uint32_t size = header->flags & ENCODER_FLAG_SHM ? 0 : header->size;
+	if (size > *buf_size) {
+		uint8_t *p = realloc(*buf, size);
+		if (!p)
+			return false;
+		*buf = p;
+		*buf_size = size;
+	}
+
+	return !size || io_read_full(fd, *buf, size, -1);
+}
+
+static bool hold_packet(struct packet_hold *hold, const uint8_t *data, uint32_t size, uint32_t end_pos,
+			uint64_t request)
+{
+	if (hold->count == hold->capacity) {
+		size_t capacity = hold->capacity ? hold->capacity * 2 : 1024;
+		struct held_packet *p = realloc(hold->packets, capacity * sizeof(*p));
+		if (!p)
+			return false;
+		hold->packets = p;
+		hold->capacity = capacity;
+	}
+
+	uint8_t *copy = malloc(size);
+	if (!copy)
+		return false;
+	memcpy(copy, data, size);
+
+	hold->packets[hold->count++] = (struct held_packet){data, copy, size, end_pos, request};
+	return true;
+}
+
+/* Checks and releases the packets of the requests before 'until'. */
+static void release_held(struct shm_ring *shm, struct packet_hold *hold, uint64_t until)
+{
+	size_t n = 0;
+	for (; n < hold->count && hold->packets[n].request < until; n++) {
+		struct held_packet *p = &hold->packets[n];
+		if (memcmp(p->data, p->copy, p->size))
+			hold->overwritten++;
+		shm_ring_arena_release(shm, p->end_pos);
+		free(p->copy);
+	}
+
+	if (n)
+		memmove(hold->packets, hold->packets + n, (hold->count - n) * sizeof(*hold->packets));
+	hold->count -= n;
+}
+
+/* Reads the replies to one encode or flush request. The packets in the arena are held if 'hold' is given. */
+static bool read_packets(int fd_data, struct shm_ring *shm, struct packet_hold *hold, uint64_t request,
+			 uint8_t **reply, size_t *reply_size, uint64_t *packets, uint64_t *packet_bytes)
+{
+	struct encoder_data_header header;
+	do {
+		if (!read_reply(fd_data, &header, reply, reply_size)) {
+			fprintf(stderr, "Error: failed to read a reply\n");
+			return false;
+		}
+		if (header.flags & ENCODER_FLAG_ERROR) {
+			fprintf(stderr, "Error: the process dropped the audio of request %llu\n",
+				(unsigned long long)request);
+			return false;
+		}
+		if (header.size) {
+			(*packets)++;
+			*packet_bytes += header.size;
+		}
+		uint32_t end_pos;
+		if ((header.flags & ENCODER_FLAG_SHM) && header.size) {
+			const uint8_t *data = shm_ring_arena_packet(shm, &header, &end_pos);
+			if (!data) {
+				fprintf(stderr, "Error: packet of %u bytes is outside of the arena\n", header.size);
+				return false;
+			}
+			if (!hold)
+				shm_ring_arena_release(shm, end_pos);
+			else if (!hold_packet(hold, data, header.size, end_pos, request))
+				return false;
+		}
+	} while (header.frames);
+
+	return true;
+}
+
+static void print_histogram(const char *name, const struct encoder_histogram *h)
+{
+	printf("%-22s p50 %u us, p99 %u us, max %u us\n", name, encoder_histogram_percentile(h, 50),
+	       encoder_histogram_percentile(h, 99), h->max);
+}
+
+/* Starts the process and creates the encoder as stream 1. 'settings' receives the settings of the reply. */
+static pid_t start_encoder(const struct bench_options *opt, struct encoder_settings *settings, int *fd_req,
+			   int *fd_data)
+{
+	pid_t pid = run_proc(opt->proc_path, fd_req, fd_data, NULL, opt->null_encoder ? "-sn" : "-s");
+	if (pid < 0)
+		return -1;
+
+	struct encoder_data_header header = {
+		.size = sizeof(*settings),
+		.frames = 0,
+		.pts = 0,
+		.flags = ENCODER_FLAG_CREATE,
+		.stream_id = 1,
+	};
+	uint8_t *reply = NULL;
+	size_t reply_size = 0;
+	bool created = io_write_full(*fd_req, &header, sizeof(header), -1) &&
+		       io_write_full(*fd_req, settings, sizeof(*settings), -1) &&
+		       read_reply(*fd_data, &header, &reply, &reply_size) && header.size == sizeof(*settings);
+	if (created)
+		memcpy(settings, reply, sizeof(*settings));
+	free(reply);
+
+	if (!created) {
+		fprintf(stderr, "Error: failed to create the encoder\n");
+		close(*fd_req);
+		close(*fd_data);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+
+	return pid;
+}
+
+/* xorshift64*, so that a seed always gives the same requests */
+static uint64_t fuzz_next(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void fuzz_fill(uint64_t *state, uint8_t *buf, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		buf[i] = (uint8_t)fuzz_next(state);
+}
+
+/* Writes the request while discarding the replies so that neither side blocks on a full pipe.
+ * Returns false once the process has closed the pipe, and sets 'timeout' if it stopped reading. */
+static bool fuzz_write(int fd_req, int fd_data, const void *data, size_t size, bool *timeout)
+{
+	const uint8_t *p = data;
+	uint8_t discard[4096];
+
+	while (size) {
+		struct pollfd fds[2] = {
+			{.fd = fd_req, .events = POLLOUT, .revents = 0},
+			{.fd = fd_data, .events = POLLIN, .revents = 0},
+		};
+		int ret = poll(fds, fd_data >= 0 ? 2 : 1, FUZZ_TIMEOUT_MS);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret == 0)
+			*timeout = true;
+		if (ret <= 0)
+			return false;
+
+		if (fds[1].revents) {
+			ssize_t n = read(fd_data, discard, sizeof(discard));
+			if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+				fd_data = -1;
+		}
+
+		if (fds[0].revents & (POLLERR | POLLHUP))
+			return false;
+		if (!(fds[0].revents & POLLOUT))
+			continue;
+
+		ssize_t n = write(fd_req, p, size);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (n < 0)
+			return false;
+		p += n;
+		size -= (size_t)n;
+	}
+
+	return true;
+}
+
+/* Rewrites the file given as the shared memory with a random header and size. */
+static void fuzz_shm_file(uint64_t *state, const char *path)
+{
+	struct encoder_shm_header header = {
+		.struct_size = fuzz_next(state) % 4 ? sizeof(header) : (uint32_t)fuzz_next(state),
+		.ring_size = 1u << (fuzz_next(state) % 32),
+		.read_pos = (uint32_t)fuzz_next(state),
+		.arena_size = fuzz_next(state) % 2 ? 0 : 1u << (fuzz_next(state) % 32),
+		.arena_read_pos = (uint32_t)fuzz_next(state),
+	};
+
+	int fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return;
+	if (fuzz_next(state) % 8)
+		io_write_full(fd, &header, sizeof(header), -1);
+	if (ftruncate(fd, (off_t)(fuzz_next(state) % (ENCODER_SHM_DATA_OFFSET + 2 * FUZZ_PAYLOAD_MAX))) < 0)
+		fprintf(stderr, "Warning: failed to resize '%s'\n", path);
+	close(fd);
+}
+
+/* Changes one field of the valid settings so that the checks after the version check are reached. */
+static void fuzz_settings(uint64_t *state, struct encoder_settings *settings, const char *shm_path)
+{
+	static const uint32_t rates[] = {0, 1, 7350, 8000, 44100, 48000, 96000, 192000, UINT32_MAX};
+
+	switch (fuzz_next(state) % 9) {
+	case 0:
+		settings->channels = (uint32_t)(fuzz_next(state) % 16);
+		break;
+	case 1:
+		settings->samplerate_in = rates[fuzz_next(state) % (sizeof(rates) / sizeof(rates[0]))];
+		break;
+	case 2:
+		settings->samplerate_out = rates[fuzz_next(state) % (sizeof(rates) / sizeof(rates[0]))];
+		break;
+	case 3:
+		settings->bitrate = (uint32_t)fuzz_next(state);
+		if (fuzz_next(state) % 2)
+			settings->bitrate %= 1024;
+		break;
+	case 4:
+		settings->quality = (uint32_t)(fuzz_next(state) % 256);
+		break;
+	case 5:
+		settings->rate_control = (uint32_t)(fuzz_next(state) % 8);
+		break;
+	case 6: // Any flag, including a shared memory with a bad header or size
+		settings->flags ^= 1u << (fuzz_next(state) % 16);
+		if (settings->flags & ENCODER_FLAG_SHM) {
+			fuzz_shm_file(state, shm_path);
+			snprintf(settings->shm_path, sizeof(settings->shm_path), "%s", shm_path);
+		}
+		break;
+	case 7: // A path without the terminator
+		settings->flags |= ENCODER_FLAG_SHM;
+		memset(settings->shm_path, 'a', sizeof(settings->shm_path));
+		break;
+	default:
+		settings->extra_data_size = (uint32_t)fuzz_next(state);
+		fuzz_fill(state, settings->extra_data, sizeof(settings->extra_data));
+		break;
+	}
+}
+
+/* Sends one request that is malformed in one of several ways. Some of them make the process exit cleanly. */
+static bool fuzz_request(uint64_t *state, int fd_req, int fd_data, uint8_t *payload,
+			 const struct encoder_settings *settings, const char *shm_path, bool *timeout)
+{
+	struct encoder_data_header header = {
+		.size = (uint32_t)(fuzz_next(state) % FUZZ_PAYLOAD_MAX),
+		.frames = (uint32_t)(fuzz_next(state) % 8),
+		.pts = (int64_t)fuzz_next(state),
+		.flags = ENCODER_FLAG_QUERY_ENCODE,
+		.stream_id = 1,
+	};
+
+	switch (fuzz_next(state) % 8) {
+	case 0: // Audio of any size, including partial frames, with random samples such as NaN
+		break;
+	case 1: // Random flags
+		header.flags = (uint32_t)fuzz_next(state);
+		header.flags &= ~(ENCODER_FLAG_CREATE | ENCODER_FLAG_SHM);
+		break;
+	case 2: // Unknown stream
+		header.stream_id = (uint32_t)fuzz_next(state);
+		break;
+	case 3: // Settings of the wrong size, or valid settings with one field changed
+		header.flags = ENCODER_FLAG_CREATE;
+		header.stream_id = (uint32_t)fuzz_next(state) % 4;
+		if (fuzz_next(state) % 8) {
+			struct encoder_settings changed = *settings;
+			fuzz_settings(state, &changed, shm_path);
+			header.size = sizeof(changed);
+			return fuzz_write(fd_req, fd_data, &header, sizeof(header), timeout) &&
+			       fuzz_write(fd_req, fd_data, &changed, sizeof(changed), timeout);
+		}
+		break;
+	case 4: // A bitrate that may be invalid, or a payload of the wrong size
+		header.flags = ENCODER_FLAG_SET_BITRATE;
+		header.size = fuzz_next(state) % 4 ? sizeof(uint32_t) : header.size % 16;
+		break;
+	case 5: // Shared memory that was never provided
+		header.flags |= ENCODER_FLAG_SHM;
+		break;
+	case 6: // A header cut short, which shifts the following requests
+		fuzz_fill(state, payload, sizeof(header));
+		return fuzz_write(fd_req, fd_data, payload, 1 + fuzz_next(state) % (sizeof(header) - 1), timeout);
+	default: // A payload larger than the process accepts, rarely
+		if (fuzz_next(state) % 16 == 0)
+			header.size = ENCODER_REQUEST_SIZE_MAX + 1;
+		break;
+	}
+
+	if (!fuzz_write(fd_req, fd_data, &header, sizeof(header), timeout))
+		return false;
+
+	if (header.flags & ENCODER_FLAG_SHM || header.size > FUZZ_PAYLOAD_MAX)
+		return true;
+
+	fuzz_fill(state, payload, header.size);
+	return fuzz_write(fd_req, fd_data, payload, header.size, timeout);
+}
+
+/*
+ * Runs sessions until the requested number of malformed requests have been sent.
+ * A session ends when the process exits, which it may do at a malformed request. It then has to exit with 0.
+ */
+static int run_fuzz(const struct bench_options *opt, const struct encoder_settings *settings)
+{
+	uint64_t state = opt->fuzz_seed ? opt->fuzz_seed : 1;
+	uint8_t *payload = malloc(FUZZ_PAYLOAD_MAX);
+	if (!payload)
+		return 1;
+
+	/* Given as the shared memory by the changed settings */
+	char shm_path[] = "/tmp/obs-coreaudio-encoder-fuzz-XXXXXX";
+	int shm_fd = mkstemp(shm_path);
+	if (shm_fd < 0) {
+		fprintf(stderr, "Error: failed to create '%s': %s\n", shm_path, strerror(errno));
+		free(payload);
+		return 1;
+	}
+	close(shm_fd);
+
+	uint32_t sent = 0, sessions = 0, failures = 0;
+	while (sent < opt->fuzz_messages) {
+		/* Each session takes one of the input formats. */
+		struct encoder_settings created = *settings;
+		if (fuzz_next(&state) % 2)
+			created.flags |= ENCODER_FLAG_PLANAR;
+		if (fuzz_next(&state) % 2)
+			created.flags |= ENCODER_FLAG_S16;
+		int fd_req = -1, fd_data = -1;
+		pid_t pid = start_encoder(opt, &created, &fd_req, &fd_data);
+		if (pid < 0) {
+			failures++;
+			break;
+		}
+		sessions++;
+
+		fcntl(fd_req, F_SETFL, fcntl(fd_req, F_GETFL) | O_NONBLOCK);
+		fcntl(fd_data, F_SETFL, fcntl(fd_data, F_GETFL) | O_NONBLOCK);
+
+		bool timeout = false;
+		uint32_t session_sent = 0;
+		while (sent < opt->fuzz_messages &&
+		       fuzz_request(&state, fd_req, fd_data, payload, &created, shm_path, &timeout)) {
+			sent++;
+			session_sent++;
+		}
+		close(fd_req);
+
+		/* The process exits once it sees the end of the requests. */
+		uint8_t discard[4096];
+		ssize_t n = 0;
+		while (!timeout && (n = io_read_some(fd_data, discard, sizeof(discard), FUZZ_TIMEOUT_MS)) > 0)
+			;
+		if (n < 0 && errno == ETIMEDOUT)
+			timeout = true;
+		close(fd_data);
+
+		if (timeout)
+			kill(pid, SIGKILL);
+		int wstatus = 0;
+		waitpid(pid, &wstatus, 0);
+
+		bool ok = !timeout && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+		if (!ok) {
+			failures++;
+			fprintf(stderr, "Error: session %u %s after %u requests\n", sessions,
+				timeout ? "hung" : "crashed", session_sent);
+		}
+	}
+
+	printf("fuzz                   %u requests in %u sessions, %u failed, seed %llu\n", sent, sessions, failures,
+	       (unsigned long long)(opt->fuzz_seed ? opt->fuzz_seed : 1));
+
+	unlink(shm_path);
+	free(payload);
+	return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_options opt = {
+		.proc_path = NULL,
+		.wav_path = NULL,
+		.channels = 2,
+		.samplerate = 48000,
+		.samplerate_out = 0,
+		.bitrate = 128,
+		.he_aac = false,
+		.quality = ENCODER_QUALITY_MAX,
+		.rate_control = ENCODER_RATE_CONTROL_CBR,
+		.duration = 60.0,
+		.frames_per_request = 1,
+		.null_encoder = false,
+		.shm = false,
+		.hold_requests = 0,
+		.fuzz_messages = 0,
+		.fuzz_seed = 1,
+	};
+
+	int c;
+	while ((c = getopt(argc, argv, "p:i:c:r:o:b:Hq:m:t:n:NsR:F:S:h")) != -1) {
+		switch (c) {
+		case 'p':
+			opt.proc_path = optarg;
+			break;
+		case 'i':
+			opt.wav_path = optarg;
+			break;
+		case 'c':
+			opt.channels = (uint32_t)atoi(optarg);
+			break;
+		case 'r':
+			opt.samplerate = (uint32_t)atoi(optarg);
+			break;
+		case 'o':
+			opt.samplerate_out = (uint32_t)atoi(optarg);
+			break;
+		case 'b':
+			opt.bitrate = (uint32_t)atoi(optarg);
+			break;
+		case 'H':
+			opt.he_aac = true;
+			break;
+		case 'q':
+			opt.quality = (uint32_t)atoi(optarg);
+			break;
+		case 'm':
+			opt.rate_control = (uint32_t)atoi(optarg);
+			break;
+		case 't':
+			opt.duration = atof(optarg);
+			break;
+		case 'n':
+			opt.frames_per_request = (uint32_t)atoi(optarg);
+			break;
+		case 'N':
+			opt.null_encoder = true;
+			break;
+		case 's':
+			opt.shm = true;
+			break;
+		case 'R':
+			opt.hold_requests = (uint32_t)atoi(optarg);
+			break;
+		case 'F':
+			opt.fuzz_messages = (uint32_t)atoi(optarg);
+			break;
+		case 'S':
+			opt.fuzz_seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!opt.proc_path || !opt.channels || !opt.samplerate || !opt.frames_per_request ||
+	    opt.frames_per_request > ENCODER_FRAMES_PER_REQUEST_MAX) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	struct pcm_source src = {.data = NULL, .samples = 0, .pos = 0, .channels = opt.channels};
+	if (opt.wav_path && !load_wav(&opt, &src))
+		return 1;
+	if (!opt.wav_path)
+		src.samples = (uint64_t)(opt.duration * opt.samplerate);
+
+	struct encoder_settings settings = {
+		.struct_size = sizeof(settings),
+		.proc_version = ENCODER_PROC_VERSION,
+		.bitrate = opt.bitrate * 1000,
+		.channels = opt.channels,
+		.samplerate_in = opt.samplerate,
+		.samplerate_out = opt.samplerate_out,
+		.flags = opt.he_aac ? ENCODER_FLAG_ALLOW_HE_AAC : 0,
+		.shm_path = {0},
+		.quality = opt.quality,
+		.rate_control = opt.rate_control,
+		.out_frames_per_packet = 0,
+		.priming_frames = 0,
+		.extra_data_size = 0,
+		.extra_data = {0},
+	};
+
+	if (opt.fuzz_messages) {
+		free(src.data);
+		return run_fuzz(&opt, &settings);
+	}
+
+	struct shm_ring shm;
+	memset(&shm, 0, sizeof(shm));
+	if (opt.shm) {
+		if (!shm_ring_create(&shm, SHM_RING_SIZE, SHM_ARENA_SIZE))
+			return 1;
+		settings.flags |= ENCODER_FLAG_SHM;
+		snprintf(settings.shm_path, sizeof(settings.shm_path), "%s", shm.path);
+	}
+
+	uint64_t t_start = os_gettime_ns();
+
+	int fd_req = -1, fd_data = -1;
+	pid_t pid = start_encoder(&opt, &settings, &fd_req, &fd_data);
+	if (opt.shm)
+		shm_ring_unlink(&shm);
+	if (pid < 0)
+		return 1;
+
+	bool use_shm = (settings.flags & ENCODER_FLAG_SHM) != 0;
+	if (opt.shm && !use_shm)
+		fprintf(stderr, "Warning: the process could not map the shared memory, using the pipe instead\n");
+
+	uint64_t t_created = os_gettime_ns();
+
+	const uint32_t request_samples = FRAME_SAMPLES * opt.frames_per_request;
+	const size_t request_bytes = (size_t)request_samples * opt.channels * sizeof(float);
+	float *pcm = malloc(request_bytes);
+	if (!pcm)
+		return 1;
+
+	struct encoder_data_header header;
+	uint8_t *reply = NULL;
+	size_t reply_size = 0;
+	struct encoder_histogram latency = {{0}, 0};
+	uint64_t packets = 0, packet_bytes = 0, requests = 0;
+	struct packet_hold hold = {NULL, 0, 0, 0};
+	struct packet_hold *held = use_shm && opt.hold_requests ? &hold : NULL;
+	int64_t pts = 0;
+
+	while (read_pcm(&src, &opt, pcm, request_samples)) {
+		header.size = (uint32_t)request_bytes;
+		header.frames = opt.frames_per_request;
+		header.pts = pts;
+		header.flags = ENCODER_FLAG_QUERY_ENCODE;
+		header.stream_id = 1;
+		pts += request_samples;
+
+		uint64_t t0 = os_gettime_ns();
+		if (use_shm && shm_ring_write(&shm, (const uint8_t *)pcm, request_bytes))
+			header.flags |= ENCODER_FLAG_SHM;
+		if (!io_write_full(fd_req, &header, sizeof(header), -1) ||
+		    (!(header.flags & ENCODER_FLAG_SHM) && !io_write_full(fd_req, pcm, request_bytes, -1))) {
+			fprintf(stderr, "Error: failed to write a request\n");
+			return 1;
+		}
+
+		if (!read_packets(fd_data, &shm, held, requests, &reply, &reply_size, &packets, &packet_bytes))
+			return 1;
+
+		encoder_histogram_add(&latency, (uint32_t)((os_gettime_ns() - t0) / 1000));
+		requests++;
+
+		if (held && requests > opt.hold_requests)
+			release_held(&shm, held, requests - opt.hold_requests);
+	}
+
+	/* The tail is included so that the packets cover the whole input. */
+	header.size = 0;
+	header.frames = 0;
+	header.flags = ENCODER_FLAG_FLUSH;
+	if (!io_write_full(fd_req, &header, sizeof(header), -1) ||
+	    !read_packets(fd_data, &shm, held, requests, &reply, &reply_size, &packets, &packet_bytes)) {
+		fprintf(stderr, "Error: failed to flush the encoder\n");
+		return 1;
+	}
+	if (held)
+		release_held(&shm, held, UINT64_MAX);
+
+	uint64_t t_end = os_gettime_ns();
+
+	struct encoder_stats stats = {0};
+	header.size = 0;
+	header.frames = 0;
+	header.flags = ENCODER_FLAG_QUERY_STATS | ENCODER_FLAG_EXIT;
+	if (io_write_full(fd_req, &header, sizeof(header), -1) && read_reply(fd_data, &header, &reply, &reply_size) &&
+	    header.size == sizeof(stats))
+		memcpy(&stats, reply, sizeof(stats));
+	close(fd_req);
+	close(fd_data);
+
+	int wstatus = 0;
+	struct rusage ru;
+	memset(&ru, 0, sizeof(ru));
+	wait4(pid, &wstatus, 0, &ru);
+
+	double audio_s = (double)src.samples / opt.samplerate;
+	double encode_s = (t_end - t_created) * 1e-9;
+
+	printf("input                  %u ch, %u Hz, %.3f s\n", opt.channels, opt.samplerate, audio_s);
+	printf("output                 %u Hz, %u kbps%s, %u samples per packet, %u priming samples%s\n",
+	       opt.samplerate_out ? opt.samplerate_out : opt.samplerate, opt.bitrate,
+	       opt.he_aac ? ", HE-AAC allowed" : "", settings.out_frames_per_packet, settings.priming_frames,
+	       opt.null_encoder ? ", null encoder" : "");
+	printf("transport              %s\n", use_shm ? "shared memory" : "pipe");
+	printf("startup                %.3f s\n", (t_created - t_start) * 1e-9);
+	printf("encode                 %.3f s, realtime factor %.1f\n", encode_s,
+	       encode_s > 0 ? audio_s / encode_s : 0.0);
+	printf("requests               %llu (%u frames each), %.0f per second\n", (unsigned long long)requests,
+	       opt.frames_per_request, encode_s > 0 ? requests / encode_s : 0.0);
+	printf("packets                %llu, %.1f kbps\n", (unsigned long long)packets,
+	       audio_s > 0 ? packet_bytes * 8 / audio_s / 1000 : 0.0);
+	if (held)
+		printf("held packets           released %u requests late, %llu overwritten\n", opt.hold_requests,
+		       (unsigned long long)hold.overwritten);
+	print_histogram("request latency", &latency);
+	if (stats.struct_size == sizeof(stats))
+		print_histogram("FillComplexBuffer", &stats.encode_us);
+	printf("co-process CPU         user %.3f s, system %.3f s\n", ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6,
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6);
+	printf("co-process peak RSS    %ld KiB\n", ru.ru_maxrss);
+	if (stats.struct_size == sizeof(stats))
+		printf("peak working set       %llu KiB\n", (unsigned long long)(stats.peak_working_set / 1024));
+
+	if (opt.shm)
+		shm_ring_destroy(&shm);
+	free(hold.packets);
+	free(pcm);
+	free(reply);
+	free(src.data);
+
+	return WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0 && !hold.overwritten ? 0 : 1;
+}
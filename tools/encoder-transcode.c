@@ -0,0 +1,338 @@
+/*
+ * OBS CoreAudio Encoder Plugin for Linux
+ * Copyright (C) 2024 Norihiro Kamae <norihiro@nagater.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Transcodes WAV files to ADTS outside OBS.
+ * Each file is encoded by its own obs-coreaudio-encoder-proc.exe in the transcode mode (option '-t'),
+ * and up to one process per core runs at a time.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <util/platform.h>
+#include "encoder-proc/encoder-proc.h"
+#include "encoder-proc/encoder-proc-version.h"
+#include "run-proc.h"
+#include "io-util.h"
+#include "wav-reader.h"
+
+#define IO_CHUNK_SIZE 65536
+
+struct transcode_options
+{
+	const char *proc_path;
+	uint32_t jobs;
+	uint32_t samplerate_out;
+	uint32_t bitrate;
+	bool he_aac;
+	uint32_t quality;
+	uint32_t rate_control;
+};
+
+struct job
+{
+	const char *in_path;
+	const char *out_path;
+	struct wav_data wav;
+
+	pid_t pid;
+	int fd_in;
+	int fd_out;
+	FILE *out;
+
+	size_t written; // bytes of the PCM data sent to the process
+	uint64_t bytes_out;
+	uint64_t start_ns;
+	bool running;
+	bool failed;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s -p obs-coreaudio-encoder-proc.exe [options] input.wav output.aac [...]\n"
+		"  -j jobs       Number of processes running at a time (default: number of cores)\n"
+		"  -o rate       Output sample rate, 0 to match the input (default: 0)\n"
+		"  -b kbps       Bitrate (default: 128)\n"
+		"  -H            Allow HE-AAC\n"
+		"  -q quality    Encoder quality from 0 to 127 (default: 127)\n"
+		"  -m mode       Rate control, 0 for CBR, 1 for ABR, 2 for constrained VBR (default: 0)\n",
+		name);
+}
+
+static bool start_job(const struct transcode_options *opt, struct job *job)
+{
+	if (!wav_load(job->in_path, &job->wav))
+		return false;
+
+	job->out = fopen(job->out_path, "wb");
+	if (!job->out) {
+		fprintf(stderr, "Error: cannot open '%s': %s\n", job->out_path, strerror(errno));
+		return false;
+	}
+
+	struct encoder_settings settings = {
+		.struct_size = sizeof(settings),
+		.proc_version = ENCODER_PROC_VERSION,
+		.bitrate = opt->bitrate * 1000,
+		.channels = job->wav.channels,
+		.samplerate_in = job->wav.samplerate,
+		.samplerate_out = opt->samplerate_out,
+		.flags = opt->he_aac ? ENCODER_FLAG_ALLOW_HE_AAC : 0,
+		.shm_path = {0},
+		.quality = opt->quality,
+		.rate_control = opt->rate_control,
+		.out_frames_per_packet = 0,
+		.priming_frames = 0,
+	};
+
+	job->start_ns = os_gettime_ns();
+	job->pid = run_proc(opt->proc_path, &job->fd_in, &job->fd_out, NULL, "-t");
+	if (job->pid < 0) {
+		job->fd_in = job->fd_out = -1;
+		return false;
+	}
+	job->running = true;
+
+	if (!io_write_full(job->fd_in, &settings, sizeof(settings), -1)) {
+		fprintf(stderr, "Error: failed to send the settings for '%s'\n", job->in_path);
+		return false;
+	}
+
+	fcntl(job->fd_in, F_SETFL, fcntl(job->fd_in, F_GETFL) | O_NONBLOCK);
+	fcntl(job->fd_out, F_SETFL, fcntl(job->fd_out, F_GETFL) | O_NONBLOCK);
+	return true;
+}
+
+static void close_fd(int *fd)
+{
+	if (*fd >= 0)
+		close(*fd);
+	*fd = -1;
+}
+
+static void finish_job(struct job *job)
+{
+	close_fd(&job->fd_in);
+	close_fd(&job->fd_out);
+
+	if (job->out && fclose(job->out) != 0)
+		job->failed = true;
+	job->out = NULL;
+
+	if (job->running) {
+		int status = 0;
+		if (waitpid(job->pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			job->failed = true;
+		job->running = false;
+	}
+
+	double elapsed = (os_gettime_ns() - job->start_ns) * 1e-9;
+	double duration = job->wav.samplerate ? (double)job->wav.samples / job->wav.samplerate : 0.0;
+	if (job->failed)
+		fprintf(stderr, "Error: failed to transcode '%s'\n", job->in_path);
+	else
+		printf("%s: %.1f s of audio in %.2f s (%.1fx realtime), %llu bytes\n", job->out_path, duration,
+		       elapsed, elapsed > 0.0 ? duration / elapsed : 0.0, (unsigned long long)job->bytes_out);
+
+	wav_free(&job->wav);
+}
+
+static void write_input(struct job *job)
+{
+	const size_t size = job->wav.samples * job->wav.channels * sizeof(float);
+	const uint8_t *data = (const uint8_t *)job->wav.data;
+
+	while (job->written < size) {
+		size_t n = size - job->written;
+		if (n > IO_CHUNK_SIZE)
+			n = IO_CHUNK_SIZE;
+		ssize_t ret = write(job->fd_in, data + job->written, n);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (ret < 0) {
+			job->failed = true;
+			break;
+		}
+		job->written += (size_t)ret;
+	}
+
+	/* The end of the input lets the process drain the encoder. */
+	close_fd(&job->fd_in);
+}
+
+/* Returns false at the end of the output. */
+static bool read_output(struct job *job, uint8_t *buf)
+{
+	while (true) {
+		ssize_t ret = read(job->fd_out, buf, IO_CHUNK_SIZE);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return true;
+		if (ret <= 0)
+			return false;
+		if (fwrite(buf, (size_t)ret, 1, job->out) != 1) {
+			job->failed = true;
+			return false;
+		}
+		job->bytes_out += (uint64_t)ret;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	struct transcode_options opt = {
+		.proc_path = NULL,
+		.jobs = cores > 0 ? (uint32_t)cores : 1,
+		.samplerate_out = 0,
+		.bitrate = 128,
+		.he_aac = false,
+		.quality = ENCODER_QUALITY_MAX,
+		.rate_control = ENCODER_RATE_CONTROL_CBR,
+	};
+
+	int c;
+	while ((c = getopt(argc, argv, "p:j:o:b:Hq:m:h")) != -1) {
+		switch (c) {
+		case 'p':
+			opt.proc_path = optarg;
+			break;
+		case 'j':
+			opt.jobs = (uint32_t)atoi(optarg);
+			break;
+		case 'o':
+			opt.samplerate_out = (uint32_t)atoi(optarg);
+			break;
+		case 'b':
+			opt.bitrate = (uint32_t)atoi(optarg);
+			break;
+		case 'H':
+			opt.he_aac = true;
+			break;
+		case 'q':
+			opt.quality = (uint32_t)atoi(optarg);
+			break;
+		case 'm':
+			opt.rate_control = (uint32_t)atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	int n_args = argc - optind;
+	if (!opt.proc_path || !opt.jobs || n_args <= 0 || n_args % 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	size_t n_jobs = (size_t)n_args / 2;
+	struct job *jobs = calloc(n_jobs, sizeof(struct job));
+	struct pollfd *fds = calloc(n_jobs * 2, sizeof(struct pollfd));
+	struct job **fd_jobs = calloc(n_jobs * 2, sizeof(struct job *));
+	uint8_t *buf = malloc(IO_CHUNK_SIZE);
+	if (!jobs || !fds || !fd_jobs || !buf) {
+		fprintf(stderr, "Error: failed to allocate memory\n");
+		return 1;
+	}
+
+	for (size_t i = 0; i < n_jobs; i++) {
+		jobs[i].in_path = argv[optind + i * 2];
+		jobs[i].out_path = argv[optind + i * 2 + 1];
+		jobs[i].fd_in = jobs[i].fd_out = -1;
+	}
+
+	uint64_t t_start = os_gettime_ns();
+	double total_duration = 0.0;
+	size_t next = 0, active = 0, failed = 0;
+
+	while (next < n_jobs || active) {
+		while (active < opt.jobs && next < n_jobs) {
+			struct job *job = &jobs[next++];
+			if (start_job(&opt, job)) {
+				active++;
+				continue;
+			}
+			job->failed = true;
+			finish_job(job);
+			failed++;
+		}
+
+		nfds_t n_fds = 0;
+		for (size_t i = 0; i < next; i++) {
+			if (jobs[i].fd_in >= 0) {
+				fds[n_fds] = (struct pollfd){.fd = jobs[i].fd_in, .events = POLLOUT};
+				fd_jobs[n_fds++] = &jobs[i];
+			}
+			if (jobs[i].fd_out >= 0) {
+				fds[n_fds] = (struct pollfd){.fd = jobs[i].fd_out, .events = POLLIN};
+				fd_jobs[n_fds++] = &jobs[i];
+			}
+		}
+
+		if (!n_fds)
+			break;
+
+		if (poll(fds, n_fds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error: poll failed: %s\n", strerror(errno));
+			break;
+		}
+
+		for (nfds_t i = 0; i < n_fds; i++) {
+			struct job *job = fd_jobs[i];
+			if (!fds[i].revents)
+				continue;
+
+			if (fds[i].fd == job->fd_in) {
+				write_input(job);
+			}
+			else if (fds[i].fd == job->fd_out && !read_output(job, buf)) {
+				finish_job(job);
+				active--;
+				if (job->failed)
+					failed++;
+				else
+					total_duration += (double)job->wav.samples / job->wav.samplerate;
+			}
+		}
+	}
+
+	double elapsed = (os_gettime_ns() - t_start) * 1e-9;
+	printf("%zu files, %zu failed, %.1f s of audio in %.2f s (%.1fx realtime) with %u jobs\n", n_jobs, failed,
+	       total_duration, elapsed, elapsed > 0.0 ? total_duration / elapsed : 0.0, opt.jobs);
+
+	free(buf);
+	free(fd_jobs);
+	free(fds);
+	free(jobs);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * OBS CoreAudio Encoder Plugin for Linux
+ * Copyright (C) 2024 Norihiro Kamae <norihiro@nagater.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wav-reader.h"
+
+static uint32_t read_le(const uint8_t *p, int n)
+{
+	uint32_t v = 0;
+	for (int i = n - 1; i >= 0; i--)
+		v = v << 8 | p[i];
+	return v;
+}
+
+bool wav_load(const char *path, struct wav_data *wav)
+{
+	memset(wav, 0, sizeof(*wav));
+
+	size_t size = 0;
+	uint8_t *buf = NULL;
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		fprintf(stderr, "Error: cannot open '%s': %s\n", path, strerror(errno));
+		return false;
+	}
+	if (fseek(fp, 0, SEEK_END) == 0) {
+		size = (size_t)ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		buf = malloc(size);
+		if (buf && fread(buf, 1, size, fp) != size)
+			size = 0;
+	}
+	fclose(fp);
+
+	if (!buf || size < 12 || memcmp(buf, "RIFF", 4) || memcmp(buf + 8, "WAVE", 4)) {
+		fprintf(stderr, "Error: '%s' is not a WAV file\n", path);
+		free(buf);
+		return false;
+	}
+
+	uint32_t format = 0, bits = 0;
+	const uint8_t *data = NULL;
+	uint32_t data_size = 0;
+	for (size_t off = 12; off + 8 <= size;) {
+		uint32_t chunk_size = read_le(buf + off + 4, 4);
+		const uint8_t *chunk = buf + off + 8;
+		if (chunk_size > size - off - 8)
+			chunk_size = (uint32_t)(size - off - 8);
+
+		if (!memcmp(buf + off, "fmt ", 4) && chunk_size >= 16) {
+			format = read_le(chunk, 2);
+			wav->channels = read_le(chunk + 2, 2);
+			wav->samplerate = read_le(chunk + 4, 4);
+			bits = read_le(chunk + 14, 2);
+			if (format == 0xFFFE && chunk_size >= 26)
+				format = read_le(chunk + 24, 2);
+		}
+		else if (!memcmp(buf + off, "data", 4)) {
+			data = chunk;
+			data_size = chunk_size;
+		}
+
+		off += 8 + chunk_size + (chunk_size & 1);
+	}
+
+	bool pcm16 = format == 1 && bits == 16;
+	bool float32 = format == 3 && bits == 32;
+	if (!data || !wav->channels || !(pcm16 || float32)) {
+		fprintf(stderr, "Error: '%s' has no data or an unsupported format %u/%u bits\n", path, format,
+			bits);
+		free(buf);
+		return false;
+	}
+
+	size_t n = data_size / (bits / 8);
+	wav->data = malloc(n * sizeof(float));
+	if (!wav->data) {
+		free(buf);
+		return false;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (pcm16)
+			wav->data[i] = (int16_t)read_le(data + i * 2, 2) / 32768.0f;
+		else
+			memcpy(&wav->data[i], data + i * 4, 4);
+	}
+	wav->samples = n / wav->channels;
+
+	free(buf);
+	return true;
+}
+
+void wav_free(struct wav_data *wav)
+{
+	free(wav->data);
+	wav->data = NULL;
+}